@@ -17,6 +17,8 @@
 //  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 //
 
+#include <iostream>
+
 #include "quaternion.hpp"
 
 
@@ -27,18 +29,14 @@ Tri::Tri() {
     p1 = {0, 0, 0};
     p2 = {0, 0, 0};
     p3 = {0, 0, 0};
+    normal = {0, 0, 0};
 }
 
 Tri::Tri(PF3D p1, PF3D p2, PF3D p3) {
     this->p1 = p1;
     this->p2 = p2;
     this->p3 = p3;
-}
-
-Tri::Tri(const Tri& other) {
-    p1 = other.p1;
-    p2 = other.p2;
-    p3 = other.p3;
+    normal = {0, 0, 0};
 }
 
 
@@ -46,13 +44,55 @@ Mesh::Mesh() {
     color = {255, 255, 255};
     location = {0, 0, 0};
     scale = {1, 1, 1};
+    _lod_scale = {1, 1, 1};
+    _lod_location = {0, 0, 0};
+    _lod_built = false;
+    _lod_hash = 0;
+    _bound_center = {0, 0, 0};
+    _bound_radius = 0;
+}
+
+Mesh::Mesh(std::vector<Tri>&& faces) : Mesh() {
+    this->faces = std::move(faces);
+}
+
+/**
+ * Helper for Mesh.
+ * Throw if indexed buffers are not valid.
+ */
+template <typename T>
+void check_indexed(const std::vector<T>& vertices, const std::vector<UINT>& indices) {
+    if (vertices.size() % 3 != 0 || indices.size() % 3 != 0) {
+        std::cerr << "Quaternion::Mesh: Buffer sizes must be multiples of 3." << std::endl;
+        throw 1;
+    }
+    const size_t num_verts = vertices.size() / 3;
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (indices[i] >= num_verts) {
+            std::cerr << "Quaternion::Mesh: Index out of range in face " << i/3 << "." << std::endl;
+            throw 1;
+        }
+    }
 }
 
-Mesh::Mesh(const Mesh& other) {
-    faces = other.faces;
-    color = other.color;
-    location = other.location;
-    scale = other.scale;
+Mesh::Mesh(std::vector<float>&& vertices, std::vector<UINT>&& indices) : Mesh() {
+    check_indexed(vertices, indices);
+    this->vertices = std::move(vertices);
+    this->indices = std::move(indices);
+}
+
+Mesh::Mesh(std::vector<double>&& vertices, std::vector<UINT>&& indices) : Mesh() {
+    check_indexed(vertices, indices);
+    this->vertices_d = std::move(vertices);
+    this->indices = std::move(indices);
+}
+
+
+Primitive::Primitive() {
+    type = SPHERE;
+    location = {0, 0, 0};
+    size = {1, 1, 1};
+    color = {255, 255, 255};
 }
 
 
@@ -78,12 +118,31 @@ Light::Light(PF3D location) {
 Scene::Scene() {
     clip_start = 0.01;
     clip_end = 1000.0;
+    lod_error = 0;
     background = {60, 60, 60};
     width = 1920;
     height = 1080;
 }
 
 
+/**
+ * Helper for mesh_from_buffers, for any vertex type.
+ */
+template <typename T>
+Mesh mesh_from_buffers_impl(const T* verts, size_t num_verts, const UINT* indices, size_t num_faces) {
+    return Mesh(std::vector<T>(verts, verts + 3*num_verts),
+        std::vector<UINT>(indices, indices + 3*num_faces));
+}
+
+Mesh mesh_from_buffers(const double* verts, size_t num_verts, const UINT* indices, size_t num_faces) {
+    return mesh_from_buffers_impl(verts, num_verts, indices, num_faces);
+}
+
+Mesh mesh_from_buffers(const float* verts, size_t num_verts, const UINT* indices, size_t num_faces) {
+    return mesh_from_buffers_impl(verts, num_verts, indices, num_faces);
+}
+
+
 Mesh primitive_cube(double size) {
     const double half = size / 2.0;
 
@@ -114,4 +173,33 @@ Mesh primitive_cube(double size) {
 }
 
 
+Primitive primitive_sphere(double radius) {
+    Primitive prim;
+    prim.type = Primitive::SPHERE;
+    prim.size = {radius, radius, radius};
+    return prim;
+}
+
+Primitive primitive_plane(PF3D normal) {
+    Primitive prim;
+    prim.type = Primitive::PLANE;
+    prim.size = normal;
+    return prim;
+}
+
+Primitive primitive_box(PF3D size) {
+    Primitive prim;
+    prim.type = Primitive::BOX;
+    prim.size = size;
+    return prim;
+}
+
+Primitive primitive_cylinder(double radius, double height) {
+    Primitive prim;
+    prim.type = Primitive::CYLINDER;
+    prim.size = {radius, radius, height};
+    return prim;
+}
+
+
 }  // namespace Quaternion
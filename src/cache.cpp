@@ -0,0 +1,304 @@
+//
+//  Quaternion
+//  3D raytracer.
+//  Copyright Patrick Huang 2021
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_set>
+
+#include "quaternion.hpp"
+
+
+namespace Quaternion {
+
+
+/**
+ * First bytes of a cache file.
+ */
+static const char CACHE_MAGIC[4] = {'Q', 'R', 'C', 'F'};
+
+/**
+ * Version of the cache file format and of tile keys.
+ * Bump this whenever either changes (including Hash), so old files are rejected.
+ */
+static const uint32_t CACHE_VERSION = 2;
+
+
+/**
+ * Helpers for tile_keys.
+ */
+void hash_value(uint64_t& hash, double value) {
+    Hash::bytes(hash, &value, sizeof(value));
+}
+
+void hash_value(uint64_t& hash, const PF3D& value) {
+    Hash::bytes(hash, value.data(), 3*sizeof(double));
+}
+
+void hash_value(uint64_t& hash, const RGB& value) {
+    Hash::bytes(hash, value.data(), 3);
+}
+
+
+/**
+ * Helper for tile_keys.
+ * Pixel bounds (x_min, x_max, y_min, y_max) covered by an axis aligned box.
+ * Returns false if the box is behind the camera.
+ * Boxes that cross the camera plane cover the whole image.
+ */
+bool screen_bounds(_4F& dest, Scene& scene, const PF3D& lo, const PF3D& hi) {
+    const double tan_x = tan(scene.cam.fov / 2);
+    const double tan_y = tan_x / scene.width * scene.height;
+
+    dest = _4F(INFINITY, -INFINITY, INFINITY, -INFINITY);
+    int behind = 0;
+    for (int i = 0; i < 8; i++) {
+        const PF3D corner((i&1) ? hi(0) : lo(0), (i&2) ? hi(1) : lo(1), (i&4) ? hi(2) : lo(2));
+        const PF3D d = corner - scene.cam.location;
+        if (d(1) <= 0) {
+            behind++;
+            continue;
+        }
+
+        // Inverse of cam_px_angle in preprocess.cpp.
+        const double px = (d(0) / d(1) / (2*tan_x) + 0.5) * scene.width;
+        const double py = (-d(2) / d(1) / (2*tan_y) + 0.5) * scene.height;
+        dest.a = std::min(dest.a, px);
+        dest.b = std::max(dest.b, px);
+        dest.c = std::min(dest.c, py);
+        dest.d = std::max(dest.d, py);
+    }
+
+    if (behind == 8)
+        return false;
+    if (behind > 0)
+        dest = _4F(-INFINITY, INFINITY, -INFINITY, INFINITY);
+    return true;
+}
+
+
+RenderCache::RenderCache() {
+    tile_size = 32;
+}
+
+std::vector<uint64_t> RenderCache::tile_keys(Scene& scene, RenderSettings& settings) {
+    const int tiles_x = (scene.width + tile_size - 1) / tile_size;
+    const int tiles_y = (scene.height + tile_size - 1) / tile_size;
+
+    // Everything that affects every tile.
+    uint64_t global = Hash::START;
+    Hash::bytes(global, &scene.width, sizeof(scene.width));
+    Hash::bytes(global, &scene.height, sizeof(scene.height));
+    Hash::bytes(global, &tile_size, sizeof(tile_size));
+    hash_value(global, scene.clip_start);
+    hash_value(global, scene.clip_end);
+    hash_value(global, scene.cam.location);
+    hash_value(global, scene.cam.fov);
+    hash_value(global, scene.background);
+    Hash::bytes(global, &settings.samples, sizeof(settings.samples));
+    Hash::bytes(global, &settings.max_bounces, sizeof(settings.max_bounces));
+
+    // Content hash and world space bounds of each mesh, then each primitive.
+    // Faces are read from _fptrs, so this is the geometry that is actually traced.
+    const int num_meshes = scene.meshes.size();
+    const int num_objs = num_meshes + scene.primitives.size();
+    std::vector<uint64_t> hashes(num_objs, Hash::START);
+    std::vector<PF3D> lo(num_objs, PF3D(INFINITY, INFINITY, INFINITY));
+    std::vector<PF3D> hi(num_objs, PF3D(-INFINITY, -INFINITY, -INFINITY));
+    std::vector<bool> infinite(num_objs, false);
+
+    for (int i = 0; i < (int)scene._fptrs.size(); i++) {
+        const Tri& tri = *scene._fptrs[i];
+        const int m = scene._mesh_ids[i];
+        for (const PF3D* p: {&tri.p1, &tri.p2, &tri.p3}) {
+            hash_value(hashes[m], *p);
+            lo[m] = lo[m].cwiseMin(*p);
+            hi[m] = hi[m].cwiseMax(*p);
+        }
+    }
+    for (int m = 0; m < num_meshes; m++)
+        hash_value(hashes[m], scene.meshes[m].color);
+
+    for (int i = 0; i < (int)scene.primitives.size(); i++) {
+        const Primitive& prim = scene.primitives[i];
+        const int o = num_meshes + i;
+        Hash::bytes(hashes[o], &prim.type, sizeof(prim.type));
+        hash_value(hashes[o], prim.location);
+        hash_value(hashes[o], prim.size);
+        hash_value(hashes[o], prim.color);
+
+        PF3D half = prim.size / 2;
+        if (prim.type == Primitive::SPHERE)
+            half = PF3D(prim.size(0), prim.size(0), prim.size(0));
+        else if (prim.type == Primitive::CYLINDER)
+            half = PF3D(prim.size(0), prim.size(0), prim.size(2)/2);
+        lo[o] = prim.location - half;
+        hi[o] = prim.location + half;
+        infinite[o] = (prim.type == Primitive::PLANE);
+    }
+
+    // Add each object to the tiles it overlaps. Adding makes the key
+    // independent of object order.
+    std::vector<uint64_t> keys(tiles_x * tiles_y);
+    for (int t = 0; t < (int)keys.size(); t++)
+        keys[t] = Hash::mix(global ^ Hash::mix(t));
+
+    for (int o = 0; o < num_objs; o++) {
+        _4F bounds(-INFINITY, INFINITY, -INFINITY, INFINITY);
+        if (!infinite[o]) {
+            if (lo[o](0) > hi[o](0))
+                continue;  // empty mesh
+            if (!screen_bounds(bounds, scene, lo[o], hi[o]))
+                continue;
+        }
+
+        // Pad a pixel for sample jitter.
+        const int tx_start = std::max(0.0, floor((bounds.a - 1) / tile_size));
+        const int tx_end = std::min((double)tiles_x - 1, floor((bounds.b + 1) / tile_size));
+        const int ty_start = std::max(0.0, floor((bounds.c - 1) / tile_size));
+        const int ty_end = std::min((double)tiles_y - 1, floor((bounds.d + 1) / tile_size));
+
+        const uint64_t obj = Hash::mix(hashes[o]);
+        for (int ty = ty_start; ty <= ty_end; ty++)
+            for (int tx = tx_start; tx <= tx_end; tx++)
+                keys[ty*tiles_x + tx] += obj;
+    }
+
+    return keys;
+}
+
+void RenderCache::prune() {
+    const std::unordered_set<uint64_t> used(_used.begin(), _used.end());
+    for (auto it = tiles.begin(); it != tiles.end();) {
+        if (used.count(it->first) == 0)
+            it = tiles.erase(it);
+        else
+            it++;
+    }
+}
+
+void RenderCache::clear() {
+    tiles.clear();
+    _used.clear();
+}
+
+bool RenderCache::save(std::string path) {
+    std::ofstream fp(path, std::ios::binary);
+    if (!fp)
+        return false;
+
+    const uint64_t count = tiles.size();
+    fp.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    fp.write((char*)&CACHE_VERSION, sizeof(CACHE_VERSION));
+    fp.write((char*)&tile_size, sizeof(tile_size));
+    fp.write((char*)&count, sizeof(count));
+    for (const auto& [key, pixels]: tiles) {
+        const uint64_t size = pixels.size();
+        fp.write((char*)&key, sizeof(key));
+        fp.write((char*)&size, sizeof(size));
+        fp.write((char*)pixels.data(), size);
+    }
+    return (bool)fp;
+}
+
+bool RenderCache::load(std::string path) {
+    std::ifstream fp(path, std::ios::binary);
+    if (!fp)
+        return false;
+
+    char magic[4];
+    uint32_t version;
+    int file_tile_size;
+    uint64_t count;
+    fp.read(magic, sizeof(magic));
+    fp.read((char*)&version, sizeof(version));
+    fp.read((char*)&file_tile_size, sizeof(file_tile_size));
+    fp.read((char*)&count, sizeof(count));
+    if (!fp || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 || version != CACHE_VERSION
+            || file_tile_size != tile_size)
+        return false;
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t key, size;
+        fp.read((char*)&key, sizeof(key));
+        fp.read((char*)&size, sizeof(size));
+        if (!fp || size > (uint64_t)tile_size*tile_size*3)
+            return false;
+
+        std::vector<UCH> pixels(size);
+        fp.read((char*)pixels.data(), size);
+        if (!fp)
+            return false;
+        tiles[key] = std::move(pixels);
+    }
+    return true;
+}
+
+
+void render(Scene& scene, Image& img, RenderSettings& settings, RenderCache& cache) {
+    if (img.width != scene.width || img.height != scene.height) {
+        std::cerr << "Quaternion::render: Dimensions must match." << std::endl;
+        throw 1;
+    }
+
+    preprocess(scene);
+    const std::vector<uint64_t> keys = cache.tile_keys(scene, settings);
+    const int tile = cache.tile_size;
+    const int tiles_x = (scene.width + tile - 1) / tile;
+
+    // Trace only the tiles that are not cached.
+    FrameBuffer fb(scene.width, scene.height, aov_bit(AOV_DEPTH));
+    std::vector<bool> cached(keys.size());
+    for (int t = 0; t < (int)keys.size(); t++) {
+        const int x = (t % tiles_x) * tile, y = (t / tiles_x) * tile;
+        const int w = std::min(tile, scene.width - x), h = std::min(tile, scene.height - y);
+
+        auto it = cache.tiles.find(keys[t]);
+        cached[t] = (it != cache.tiles.end() && (int)it->second.size() == w*h*3);
+        if (!cached[t])
+            render_region(scene, fb, settings, x, y, x+w, y+h);
+    }
+
+    tonemap(fb, img, AOV_DEPTH);
+
+    // Copy cached tiles into the image, and new tiles into the cache.
+    for (int t = 0; t < (int)keys.size(); t++) {
+        const int x = (t % tiles_x) * tile, y = (t / tiles_x) * tile;
+        const int w = std::min(tile, scene.width - x), h = std::min(tile, scene.height - y);
+
+        std::vector<UCH>& pixels = cache.tiles[keys[t]];
+        if (!cached[t])
+            pixels.resize(w*h*3);
+        for (int row = 0; row < h; row++) {
+            UCH* img_row = img.row(y+row) + 3*x;
+            UCH* tile_row = pixels.data() + row*w*3;
+            if (cached[t])
+                memcpy(img_row, tile_row, w*3);
+            else
+                memcpy(tile_row, img_row, w*3);
+        }
+    }
+
+    cache._used = keys;
+}
+
+
+}  // namespace Quaternion
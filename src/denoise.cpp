@@ -0,0 +1,173 @@
+//
+//  Quaternion
+//  3D raytracer.
+//  Copyright Patrick Huang 2021
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "quaternion.hpp"
+
+
+namespace Quaternion {
+
+
+typedef  Eigen::Array<float, Eigen::Dynamic, 1>  ArrayF;
+typedef  Eigen::Array<UINT, Eigen::Dynamic, 1>   ArrayU;
+typedef  Eigen::Array<bool, Eigen::Dynamic, 1>   ArrayB;
+
+
+DenoiseSettings::DenoiseSettings() {
+    radius = 3;
+    threshold = 0.01;
+    coherence = 0.6;
+    sigma = 2;
+    threads = 0;
+}
+
+
+/**
+ * Helper for denoise.
+ * Separable gaussian blur of a width * height plane in place, clamped at the edges.
+ * Every tap is a whole (shifted) row, so both passes are array operations.
+ */
+void blur_plane(ArrayF& plane, int width, int height, double sigma, UINT threads) {
+    const int r = std::max(1, (int)ceil(sigma));
+    std::vector<float> kernel(2*r + 1);
+    float total = 0;
+    for (int k = -r; k <= r; k++) {
+        kernel[k+r] = exp(-k*k / (2*sigma*sigma));
+        total += kernel[k+r];
+    }
+    for (float& w: kernel)
+        w /= total;
+
+    ArrayF tmp(plane.size());
+    parallel_for(0, height, [&](int y) {
+        const size_t start = (size_t)y * width;
+        auto out = tmp.segment(start, width);
+        out.setZero();
+        for (int k = -r; k <= r; k++) {
+            // x in [lo, hi) reads x+k inside the row, others read the nearest end.
+            const int lo = std::min(std::max(0, -k), width), hi = std::max(std::min(width, width-k), lo);
+            out.segment(lo, hi-lo) += kernel[k+r] * plane.segment(start+lo+k, hi-lo);
+            out.head(lo) += kernel[k+r] * plane(start);
+            out.tail(width-hi) += kernel[k+r] * plane(start+width-1);
+        }
+    }, threads);
+
+    parallel_for(0, height, [&](int y) {
+        auto out = plane.segment((size_t)y*width, width);
+        out.setZero();
+        for (int k = -r; k <= r; k++) {
+            const int sy = std::min(std::max(y+k, 0), height-1);
+            out += kernel[k+r] * tmp.segment((size_t)sy*width, width);
+        }
+    }, threads);
+}
+
+/**
+ * Helper for denoise.
+ * Bilinear sample of a width * height plane, clamped at the edges.
+ */
+float sample_plane(const ArrayF& plane, int width, int height, float x, float y) {
+    x = std::min(std::max(x, 0.0f), width - 1.0f);
+    y = std::min(std::max(y, 0.0f), height - 1.0f);
+    const int x0 = std::min((int)x, std::max(width-2, 0)), y0 = std::min((int)y, std::max(height-2, 0));
+    const int x1 = std::min(x0+1, width-1), y1 = std::min(y0+1, height-1);
+    const float fx = x - x0, fy = y - y0;
+    const float top = (1-fx) * plane((size_t)y0*width + x0) + fx * plane((size_t)y0*width + x1);
+    const float bottom = (1-fx) * plane((size_t)y1*width + x0) + fx * plane((size_t)y1*width + x1);
+    return (1-fy) * top + fy * bottom;
+}
+
+void denoise(FrameBuffer& fb, DenoiseSettings& settings) {
+    if (!fb.has(AOV_COLOR)) {
+        std::cerr << "Quaternion::denoise: Frame buffer has no color." << std::endl;
+        throw 1;
+    }
+
+    const int width = fb.width, height = fb.height;
+    const size_t size = (size_t)width * height;
+    if (size == 0)
+        return;
+
+    // Average color in planes, so rows are contiguous arrays.
+    const ArrayF samples = Eigen::Map<ArrayU>(fb.samples.data(), size).cast<float>().max(1.0f);
+    ArrayF color[3];
+    for (int c = 0; c < 3; c++)
+        color[c] = Eigen::Map<ArrayF, 0, Eigen::InnerStride<3>>(fb.color.data()+c, size) / samples;
+    const ArrayF lum = color[0] + color[1] + color[2];
+
+    // Structure tensor of the Sobel gradient of lum, 0 on the border.
+    ArrayF jxx = ArrayF::Zero(size), jxy = ArrayF::Zero(size), jyy = ArrayF::Zero(size);
+    if (width >= 3) {
+        parallel_for(1, height-1, [&](int y) {
+            const int n = width - 2;
+            auto l = [&](int dx, int dy) { return lum.segment((size_t)(y+dy)*width + 1 + dx, n); };
+            const ArrayF gx = (l(1, -1) + 2*l(1, 0) + l(1, 1) - l(-1, -1) - 2*l(-1, 0) - l(-1, 1)) / 8;
+            const ArrayF gy = (l(-1, 1) + 2*l(0, 1) + l(1, 1) - l(-1, -1) - 2*l(0, -1) - l(1, -1)) / 8;
+            const size_t start = (size_t)y*width + 1;
+            jxx.segment(start, n) = gx * gx;
+            jxy.segment(start, n) = gx * gy;
+            jyy.segment(start, n) = gy * gy;
+        }, settings.threads);
+    }
+    blur_plane(jxx, width, height, settings.sigma, settings.threads);
+    blur_plane(jxy, width, height, settings.sigma, settings.threads);
+    blur_plane(jyy, width, height, settings.sigma, settings.threads);
+
+    // Eigenvalues give edge strength and coherence. The eigenvector of the
+    // larger one is the gradient direction, the edge is perpendicular.
+    const ArrayF half_tr = (jxx + jyy) / 2;
+    const ArrayF disc = ((jxx - jyy).square() / 4 + jxy.square()).sqrt();
+    const ArrayF l1 = half_tr + disc, l2 = half_tr - disc;
+    const float min_l1 = settings.threshold * settings.threshold;
+    const ArrayB edge = (l1 >= min_l1) && (l1 - l2 >= (float)settings.coherence * (l1 + l2 + 1e-12f));
+
+    const ArrayB axis = jxy.abs() <= 1e-12f;
+    const ArrayB horizontal = jxx >= jyy;
+    const ArrayF ex = axis.select(horizontal.select(ArrayF::Ones(size), 0.0f), l1 - jyy);
+    const ArrayF ey = axis.select(horizontal.select(ArrayF::Zero(size), 1.0f), jxy);
+    const ArrayF len = (ex.square() + ey.square()).sqrt().max(1e-12f);
+    const ArrayF tx = -ey / len, ty = ex / len;
+
+    // Average edge pixels along the edge. Other pixels keep their color.
+    const int radius = settings.radius;
+    ArrayF out[3] = {color[0], color[1], color[2]};
+    parallel_for(0, height, [&](int y) {
+        for (int x = 0; x < width; x++) {
+            const size_t i = (size_t)y*width + x;
+            if (!edge(i))
+                continue;
+            for (int c = 0; c < 3; c++) {
+                float sum = 0;
+                for (int k = -radius; k <= radius; k++)
+                    sum += sample_plane(color[c], width, height, x + k*tx(i), y + k*ty(i));
+                out[c](i) = sum / (2*radius + 1);
+            }
+        }
+    }, settings.threads);
+
+    for (int c = 0; c < 3; c++)
+        Eigen::Map<ArrayF, 0, Eigen::InnerStride<3>>(fb.color.data()+c, size) = out[c] * samples;
+}
+
+
+}  // namespace Quaternion
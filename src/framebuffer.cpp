@@ -0,0 +1,173 @@
+//
+//  Quaternion
+//  3D raytracer.
+//  Copyright Patrick Huang 2021
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+
+#include <algorithm>
+#include <iostream>
+
+#include "quaternion.hpp"
+
+
+namespace Quaternion {
+
+
+typedef  Eigen::Array<float, Eigen::Dynamic, 1>  ArrayF;
+typedef  Eigen::Array<UINT, Eigen::Dynamic, 1>   ArrayU;
+typedef  Eigen::Array<UCH, Eigen::Dynamic, 1>    ArrayC;
+
+
+FrameBuffer::FrameBuffer(int width, int height, int aovs) {
+    this->width = width;
+    this->height = height;
+    this->aovs = aovs;
+    const size_t size = (size_t)width * height;
+    if (has(AOV_COLOR))
+        color.resize(size*3);
+    if (has(AOV_DEPTH))
+        depth.resize(size);
+    if (has(AOV_NORMAL))
+        normal.resize(size*3);
+    if (has(AOV_MESH_ID))
+        mesh_id.resize(size);
+    if (has(AOV_FACE_ID))
+        face_id.resize(size);
+    if (has(AOV_MESH_ID) || has(AOV_FACE_ID))
+        _closest.resize(size);
+    hits.resize(size);
+    samples.resize(size);
+    clear();
+}
+
+bool FrameBuffer::has(AOV aov) const {
+    return (aovs & aov_bit(aov)) != 0;
+}
+
+int FrameBuffer::index(int x, int y) {
+    return y*width + x;
+}
+
+void FrameBuffer::clear() {
+    std::fill(color.begin(), color.end(), 0);
+    std::fill(depth.begin(), depth.end(), 0);
+    std::fill(normal.begin(), normal.end(), 0);
+    std::fill(mesh_id.begin(), mesh_id.end(), -1);
+    std::fill(face_id.begin(), face_id.end(), -1);
+    std::fill(hits.begin(), hits.end(), 0);
+    std::fill(samples.begin(), samples.end(), 0);
+    std::fill(_closest.begin(), _closest.end(), 0);
+}
+
+
+/**
+ * Helper for tonemap.
+ * Clamp to [0, 255], round, and write to img.
+ * values has one entry per channel if channels is 3, or one per pixel
+ * (copied to all channels) if channels is 1.
+ */
+void quantize(const ArrayF& values, Image& img, int channels) {
+    const int size = img.width * img.height;
+    const ArrayC q = (values.max(0.0f).min(255.0f) + 0.5f).cast<UCH>();
+
+    if (channels == 3) {
+        Eigen::Map<ArrayC>(img.mem, size*3) = q;
+    } else {
+        for (int i = 0; i < size; i++)
+            img.mem[3*i] = img.mem[3*i+1] = img.mem[3*i+2] = q(i);
+    }
+}
+
+/**
+ * Helper for tonemap.
+ * Distinct color for each ID. Black if id < 0.
+ */
+void id_color(UCH* dest, int id) {
+    if (id < 0) {
+        dest[0] = dest[1] = dest[2] = 0;
+        return;
+    }
+    UINT h = (UINT)id * 2654435761u;
+    h ^= h >> 15;
+    dest[0] = 64 + (h & 127);
+    dest[1] = 64 + ((h >> 8) & 127);
+    dest[2] = 64 + ((h >> 16) & 127);
+}
+
+void tonemap(FrameBuffer& fb, Image& img, AOV aov, double exposure) {
+    if (img.width != fb.width || img.height != fb.height) {
+        std::cerr << "Quaternion::tonemap: Dimensions must match." << std::endl;
+        throw 1;
+    }
+    if (!fb.has(aov)) {
+        std::cerr << "Quaternion::tonemap: AOV is not in the frame buffer." << std::endl;
+        throw 1;
+    }
+
+    const int size = fb.width * fb.height;
+    const ArrayF samples = Eigen::Map<ArrayU>(fb.samples.data(), size).cast<float>().max(1.0f);
+    const ArrayF hits = Eigen::Map<ArrayU>(fb.hits.data(), size).cast<float>();
+
+    switch (aov) {
+        case AOV_COLOR: {
+            // Interleaved, so scale each channel by the pixel's sample count.
+            Eigen::Map<ArrayF, 0, Eigen::InnerStride<3>> r(fb.color.data(), size);
+            Eigen::Map<ArrayF, 0, Eigen::InnerStride<3>> g(fb.color.data()+1, size);
+            Eigen::Map<ArrayF, 0, Eigen::InnerStride<3>> b(fb.color.data()+2, size);
+            const ArrayF scale = (float)(255.0 * exposure) / samples;
+            ArrayF values(size*3);
+            Eigen::Map<ArrayF, 0, Eigen::InnerStride<3>>(values.data(), size) = r * scale;
+            Eigen::Map<ArrayF, 0, Eigen::InnerStride<3>>(values.data()+1, size) = g * scale;
+            Eigen::Map<ArrayF, 0, Eigen::InnerStride<3>>(values.data()+2, size) = b * scale;
+            quantize(values, img, 3);
+            break;
+        }
+
+        case AOV_DEPTH: {
+            const ArrayF depth = Eigen::Map<ArrayF>(fb.depth.data(), size);
+            quantize((hits > 0).select(255.0f * samples / depth.max(1e-6f), 0.0f), img, 1);
+            break;
+        }
+
+        case AOV_NORMAL: {
+            ArrayF values(size*3);
+            for (int c = 0; c < 3; c++) {
+                Eigen::Map<ArrayF, 0, Eigen::InnerStride<3>> n(fb.normal.data()+c, size);
+                Eigen::Map<ArrayF, 0, Eigen::InnerStride<3>>(values.data()+c, size) =
+                    (hits > 0).select((n / hits.max(1.0f) * 0.5f + 0.5f) * 255.0f, 0.0f);
+            }
+            quantize(values, img, 3);
+            break;
+        }
+
+        case AOV_MESH_ID:
+        case AOV_FACE_ID: {
+            const std::vector<int>& ids = (aov == AOV_MESH_ID) ? fb.mesh_id : fb.face_id;
+            for (int i = 0; i < size; i++)
+                id_color(img.mem + 3*i, ids[i]);
+            break;
+        }
+
+        case AOV_HITS: {
+            quantize(255.0f * hits / samples, img, 1);
+            break;
+        }
+    }
+}
+
+
+}  // namespace Quaternion
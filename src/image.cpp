@@ -17,7 +17,17 @@
 //  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 //
 
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iostream>
 
 #include "quaternion.hpp"
 
@@ -25,39 +35,321 @@
 namespace Quaternion {
 
 
+/**
+ * Helper for Image.
+ * Allocate bytes (rounded up to 64), aligned to 64.
+ */
+UCH* image_alloc(size_t bytes) {
+    void* mem = std::aligned_alloc(64, bytes);
+    if (mem == nullptr) {
+        std::cerr << "Quaternion::Image: Could not allocate " << bytes << " bytes." << std::endl;
+        throw 1;
+    }
+    return (UCH*)mem;
+}
+
+/**
+ * Helper for Image.
+ * Map bytes of the file at path, creating or resizing it.
+ */
+UCH* image_map(size_t bytes, const std::string& path) {
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, bytes) < 0) {
+        if (fd >= 0)
+            close(fd);
+        std::cerr << "Quaternion::Image: Could not open " << path << "." << std::endl;
+        throw 1;
+    }
+    void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        std::cerr << "Quaternion::Image: Could not map " << path << "." << std::endl;
+        throw 1;
+    }
+    return (UCH*)mem;
+}
+
+/**
+ * Helper for Image.
+ * Free memory from image_alloc or image_map.
+ */
+void image_free(UCH* mem, size_t bytes, bool mapped) {
+    if (mem == nullptr)
+        return;
+    if (mapped)
+        munmap(mem, bytes);
+    else
+        std::free(mem);
+}
+
+
 Image::~Image() {
-    delete[] mem;
+    image_free(mem, _bytes, _mapped);
 }
 
 Image::Image(int width, int height) {
     this->width = width;
     this->height = height;
-    mem = new UCH[width*height*3];
+    _mapped = false;
+    _bytes = std::max<size_t>(64, ((size_t)width*height*3 + 63) / 64 * 64);
+    mem = image_alloc(_bytes);
+}
+
+Image::Image(int width, int height, const std::string& path) {
+    this->width = width;
+    this->height = height;
+    _mapped = true;
+    _bytes = std::max<size_t>(64, ((size_t)width*height*3 + 63) / 64 * 64);
+    mem = image_map(_bytes, path);
+}
+
+Image::Image(const Image& other) : Image(other.width, other.height) {
+    if (other.mem != nullptr)
+        memcpy(mem, other.mem, (size_t)width*height*3);
+}
+
+Image::Image(Image&& other) noexcept {
+    mem = other.mem;
+    width = other.width;
+    height = other.height;
+    _mapped = other._mapped;
+    _bytes = other._bytes;
+
+    other.mem = nullptr;
+    other.width = other.height = 0;
+    other._bytes = 0;
 }
 
-int Image::mempos(int x, int y, int channel) {
-    return y*width*3 + x*3 + channel;
+Image& Image::operator=(const Image& other) {
+    if (this != &other) {
+        Image copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+Image& Image::operator=(Image&& other) noexcept {
+    if (this != &other) {
+        image_free(mem, _bytes, _mapped);
+        mem = other.mem;
+        width = other.width;
+        height = other.height;
+        _mapped = other._mapped;
+        _bytes = other._bytes;
+
+        other.mem = nullptr;
+        other.width = other.height = 0;
+        other._bytes = 0;
+    }
+    return *this;
 }
 
 void Image::clear() {
-    memset(mem, 0, 3 * width * height);
+    if (mem != nullptr)
+        memset(mem, 0, (size_t)width*height*3);
 }
 
-UCH Image::get(int x, int y, int channel) {
-    return mem[mempos(x, y, channel)];
+
+void Image::fill(const RGB& color) {
+    if (mem == nullptr || width == 0 || height == 0)
+        return;
+
+    // Fill the first row, then copy it to the others.
+    UCH* first = row(0);
+    for (int x = 0; x < width; x++) {
+        first[3*x] = color(0);
+        first[3*x+1] = color(1);
+        first[3*x+2] = color(2);
+    }
+    for (int y = 1; y < height; y++)
+        memcpy(row(y), first, width*3);
 }
 
-void Image::set(int x, int y, int channel, UCH value) {
-    mem[mempos(x, y, channel)] = value;
+void Image::blit(const Image& src, int x, int y) {
+    const int x_start = std::max(0, -x), x_end = std::min(src.width, width-x);
+    const int y_start = std::max(0, -y), y_end = std::min(src.height, height-y);
+    if (x_start >= x_end)
+        return;
+
+    for (int sy = y_start; sy < y_end; sy++)
+        memcpy(row(y+sy) + 3*(x+x_start), src.row(sy) + 3*x_start, 3*(x_end-x_start));
 }
 
-void Image::write(std::string path) {
+/**
+ * Helper for downsample_box and downsample_lanczos.
+ */
+void check_factor(int factor) {
+    if (factor <= 0) {
+        std::cerr << "Quaternion::Image: Downsample factor must be positive." << std::endl;
+        throw 1;
+    }
+}
+
+Image Image::downsample_box(int factor) const {
+    check_factor(factor);
+    Image out(width/factor, height/factor);
+    const int row_len = out.width * factor * 3;
+    const UINT area = factor * factor;
+    std::vector<UINT> acc(row_len);
+
+    for (int oy = 0; oy < out.height; oy++) {
+        // Sum source rows vertically, then blocks horizontally.
+        std::fill(acc.begin(), acc.end(), 0);
+        for (int sy = oy*factor; sy < (oy+1)*factor; sy++) {
+            const UCH* src = row(sy);
+            for (int i = 0; i < row_len; i++)
+                acc[i] += src[i];
+        }
+
+        UCH* dest = out.row(oy);
+        for (int ox = 0; ox < out.width; ox++) {
+            for (int c = 0; c < 3; c++) {
+                UINT sum = 0;
+                for (int k = 0; k < factor; k++)
+                    sum += acc[3*(ox*factor+k) + c];
+                dest[3*ox+c] = (sum + area/2) / area;
+            }
+        }
+    }
+
+    return out;
+}
+
+
+/**
+ * Helper for downsample_lanczos.
+ * Lanczos kernel with a = 3.
+ */
+double lanczos3(double x) {
+    if (x == 0)
+        return 1;
+    if (std::abs(x) >= 3)
+        return 0;
+    const double px = M_PI * x;
+    return 3 * sin(px) * sin(px/3) / (px*px);
+}
+
+/**
+ * Helper for downsample_lanczos.
+ * Source index of the first tap and normalized weights of all taps,
+ * for each output index along one axis.
+ */
+void lanczos_taps(std::vector<int>& starts, std::vector<float>& weights, int out_size, int factor) {
+    const int taps = 6 * factor;
+    starts.resize(out_size);
+    weights.resize(out_size * taps);
+
+    for (int o = 0; o < out_size; o++) {
+        const double center = (o + 0.5) * factor - 0.5;
+        starts[o] = (int)floor(center) - 3*factor + 1;
+
+        double total = 0;
+        for (int k = 0; k < taps; k++) {
+            const double w = lanczos3((starts[o] + k - center) / factor);
+            weights[o*taps + k] = w;
+            total += w;
+        }
+        for (int k = 0; k < taps; k++)
+            weights[o*taps + k] /= total;
+    }
+}
+
+Image Image::downsample_lanczos(int factor) const {
+    check_factor(factor);
+    Image out(width/factor, height/factor);
+    const int taps = 6 * factor;
+
+    std::vector<int> x_starts, y_starts;
+    std::vector<float> x_weights, y_weights;
+    lanczos_taps(x_starts, x_weights, out.width, factor);
+    lanczos_taps(y_starts, y_weights, out.height, factor);
+
+    // Horizontal pass into floats: height rows of out.width pixels.
+    const int tmp_len = out.width * 3;
+    std::vector<float> tmp((size_t)height * tmp_len);
+    for (int y = 0; y < height; y++) {
+        const UCH* src = row(y);
+        float* dest = tmp.data() + (size_t)y*tmp_len;
+        for (int ox = 0; ox < out.width; ox++) {
+            float sum[3] = {0, 0, 0};
+            for (int k = 0; k < taps; k++) {
+                const int sx = std::min(std::max(x_starts[ox] + k, 0), width-1);
+                const float w = x_weights[ox*taps + k];
+                sum[0] += w * src[3*sx];
+                sum[1] += w * src[3*sx+1];
+                sum[2] += w * src[3*sx+2];
+            }
+            dest[3*ox] = sum[0];
+            dest[3*ox+1] = sum[1];
+            dest[3*ox+2] = sum[2];
+        }
+    }
+
+    // Vertical pass, one whole row at a time.
+    std::vector<float> acc(tmp_len);
+    for (int oy = 0; oy < out.height; oy++) {
+        std::fill(acc.begin(), acc.end(), 0);
+        for (int k = 0; k < taps; k++) {
+            const int sy = std::min(std::max(y_starts[oy] + k, 0), height-1);
+            const float w = y_weights[oy*taps + k];
+            const float* src = tmp.data() + (size_t)sy*tmp_len;
+            for (int i = 0; i < tmp_len; i++)
+                acc[i] += w * src[i];
+        }
+
+        UCH* dest = out.row(oy);
+        for (int i = 0; i < tmp_len; i++)
+            dest[i] = std::min(std::max(acc[i] + 0.5f, 0.0f), 255.0f);
+    }
+
+    return out;
+}
+
+
+void Image::swizzle(int c0, int c1, int c2) {
+    if (c0 < 0 || c0 > 2 || c1 < 0 || c1 > 2 || c2 < 0 || c2 > 2) {
+        std::cerr << "Quaternion::Image::swizzle: Channels must be 0, 1 or 2." << std::endl;
+        throw 1;
+    }
+    if (mem == nullptr)
+        return;
+
+    const size_t size = (size_t)width * height;
+    for (size_t i = 0; i < size; i++) {
+        UCH* px = mem + 3*i;
+        const UCH old[3] = {px[0], px[1], px[2]};
+        px[0] = old[c0];
+        px[1] = old[c1];
+        px[2] = old[c2];
+    }
+}
+
+void Image::to_float(std::vector<float>& dest, float scale) const {
+    const size_t size = (mem == nullptr) ? 0 : (size_t)width * height * 3;
+    dest.resize(size);
+    for (size_t i = 0; i < size; i++)
+        dest[i] = mem[i] * scale;
+}
+
+void Image::from_float(const std::vector<float>& src, float scale) {
+    const size_t size = (mem == nullptr) ? 0 : (size_t)width * height * 3;
+    if (src.size() < size) {
+        std::cerr << "Quaternion::Image::from_float: Not enough values." << std::endl;
+        throw 1;
+    }
+    for (size_t i = 0; i < size; i++)
+        mem[i] = std::min(std::max(src[i] * scale + 0.5f, 0.0f), 255.0f);
+}
+
+
+void Image::write(std::string path) const {
     std::ofstream fp(path);
 
     fp.write((char*)&width, sizeof(width));
     fp.write((char*)&height, sizeof(height));
-    fp.write((char*)mem, width*height*3);
+    if (mem != nullptr)
+        fp.write((char*)mem, (size_t)width*height*3);
 }
 
 
-}
+}  // namespace Quaternion
@@ -0,0 +1,518 @@
+//
+//  Quaternion
+//  3D raytracer.
+//  Copyright Patrick Huang 2021
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <queue>
+#include <unordered_map>
+
+#include "quaternion.hpp"
+
+
+namespace Quaternion {
+
+
+/**
+ * Meshes with fewer faces than this get no levels of detail.
+ */
+static const int LOD_MIN_FACES = 1024;
+
+/**
+ * Stop adding levels once they would have fewer faces than this.
+ */
+static const int LOD_MIN_LEVEL_FACES = 64;
+
+/**
+ * Weight of the planes that keep open boundaries in place.
+ */
+static const double BOUNDARY_WEIGHT = 1000;
+
+
+typedef  Eigen::Matrix4d  Quadric;
+
+
+/**
+ * Helper for Decimator.
+ * Quadric of squared distance to the plane through point with unit normal n.
+ */
+Quadric plane_quadric(const PF3D& point, const PF3D& n, double weight) {
+    const Eigen::Vector4d plane(n(0), n(1), n(2), -n.dot(point));
+    return weight * plane * plane.transpose();
+}
+
+/**
+ * Helper for Decimator.
+ * Squared distance error of moving a vertex with quadric q to p.
+ */
+double quadric_error(const Quadric& q, const PF3D& p) {
+    const Eigen::Vector4d v(p(0), p(1), p(2), 1);
+    return std::max(0.0, v.dot(q * v));
+}
+
+
+/**
+ * Helper for Decimator.
+ * Distance from p to triangle (a, b, c). From Ericson, Real-Time Collision Detection 5.1.5.
+ */
+double point_tri_dist(const PF3D& p, const PF3D& a, const PF3D& b, const PF3D& c) {
+    const PF3D ab = b - a, ac = c - a, ap = p - a;
+    const double d1 = ab.dot(ap), d2 = ac.dot(ap);
+    if (d1 <= 0 && d2 <= 0)
+        return ap.norm();
+
+    const PF3D bp = p - b;
+    const double d3 = ab.dot(bp), d4 = ac.dot(bp);
+    if (d3 >= 0 && d4 <= d3)
+        return bp.norm();
+
+    const double vc = d1*d4 - d3*d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0)
+        return (p - (a + d1 / (d1-d3) * ab)).norm();
+
+    const PF3D cp = p - c;
+    const double d5 = ab.dot(cp), d6 = ac.dot(cp);
+    if (d6 >= 0 && d5 <= d6)
+        return cp.norm();
+
+    const double vb = d5*d2 - d1*d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0)
+        return (p - (a + d2 / (d2-d6) * ac)).norm();
+
+    const double va = d3*d6 - d5*d4;
+    if (va <= 0 && d4-d3 >= 0 && d5-d6 >= 0)
+        return (p - (b + (d4-d3) / ((d4-d3) + (d5-d6)) * (c - b))).norm();
+
+    const double denom = va + vb + vc;
+    if (denom <= 0)
+        return ap.norm();
+    return (p - (a + ab * (vb/denom) + ac * (vc/denom))).norm();
+}
+
+
+/**
+ * Candidate edge collapse in the heap.
+ * Only valid if both vertices are alive and unchanged since it was pushed.
+ */
+struct Collapse {
+    double cost;
+    int a, b;
+    int version_a, version_b;
+    PF3D target;
+
+    bool operator>(const Collapse& other) const {
+        return cost > other.cost;
+    }
+};
+
+/**
+ * Garland and Heckbert quadric edge collapse on an indexed copy of a mesh.
+ */
+struct Decimator {
+    std::vector<PF3D> pos;
+    std::vector<Quadric> quadrics;
+
+    /**
+     * Welded input positions, and the vertex each one was collapsed into
+     * (follow until a vertex points to itself). For measuring error.
+     */
+    std::vector<PF3D> original;
+    std::vector<int> merged_into;
+    std::vector<int> version;
+    std::vector<bool> vert_alive;
+    std::vector<std::vector<int>> vert_faces;
+
+    std::vector<std::array<int, 3>> faces;
+    std::vector<bool> face_alive;
+    int num_faces;
+
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+
+    /**
+     * Vertex that v was collapsed into.
+     */
+    int find(int v);
+
+    /**
+     * Largest distance from an input vertex to the closest face around
+     * the vertex it was collapsed into.
+     * Measured directly, so boundary weights and summed quadrics do not
+     * inflate it.
+     */
+    double error();
+
+    Decimator(const std::vector<Tri>& tris);
+
+    void push_edge(int a, int b);
+
+    /**
+     * Whether moving vertex v to p flips any face around it.
+     * Faces containing other are ignored, they are removed by the collapse.
+     */
+    bool flips(int v, int other, const PF3D& p);
+
+    /**
+     * Collapse edges until at most target faces remain.
+     * Returns false if no more edges can be collapsed.
+     */
+    bool reduce(int target);
+
+    /**
+     * Alive faces as a compact indexed level.
+     */
+    LodLevel level();
+};
+
+/**
+ * Hash of a point, for welding.
+ */
+struct PointHash {
+    size_t operator()(const std::array<double, 3>& p) const {
+        uint64_t hash = Hash::START;
+        Hash::bytes(hash, p.data(), sizeof(p));
+        return hash;
+    }
+};
+
+Decimator::Decimator(const std::vector<Tri>& tris) {
+    // Weld identical positions into shared vertices.
+    std::unordered_map<std::array<double, 3>, int, PointHash> ids;
+    faces.reserve(tris.size());
+    for (const Tri& tri: tris) {
+        std::array<int, 3> face;
+        const PF3D* pts[3] = {&tri.p1, &tri.p2, &tri.p3};
+        for (int k = 0; k < 3; k++) {
+            const std::array<double, 3> key = {(*pts[k])(0), (*pts[k])(1), (*pts[k])(2)};
+            auto it = ids.find(key);
+            if (it == ids.end()) {
+                it = ids.emplace(key, pos.size()).first;
+                pos.push_back(*pts[k]);
+            }
+            face[k] = it->second;
+        }
+        if (face[0] != face[1] && face[1] != face[2] && face[0] != face[2])
+            faces.push_back(face);
+    }
+
+    const int num_verts = pos.size();
+    num_faces = faces.size();
+    quadrics.assign(num_verts, Quadric::Zero());
+    original = pos;
+    merged_into.resize(num_verts);
+    for (int v = 0; v < num_verts; v++)
+        merged_into[v] = v;
+    version.assign(num_verts, 0);
+    vert_alive.assign(num_verts, true);
+    vert_faces.resize(num_verts);
+    face_alive.assign(num_faces, true);
+
+    // Face planes, and edge use counts to find boundaries.
+    std::unordered_map<uint64_t, std::pair<int, int>> edges;  // key -> (count, face)
+    for (int f = 0; f < num_faces; f++) {
+        const std::array<int, 3>& face = faces[f];
+        PF3D n = (pos[face[1]] - pos[face[0]]).cross(pos[face[2]] - pos[face[0]]);
+        if (n.norm() > 0)
+            n.normalize();
+        const Quadric q = plane_quadric(pos[face[0]], n, 1);
+        for (int k = 0; k < 3; k++) {
+            quadrics[face[k]] += q;
+            vert_faces[face[k]].push_back(f);
+
+            const int a = std::min(face[k], face[(k+1)%3]), b = std::max(face[k], face[(k+1)%3]);
+            auto& edge = edges[((uint64_t)a << 32) | b];
+            edge.first++;
+            edge.second = f;
+        }
+    }
+
+    // Planes perpendicular to boundary edges hold open edges in place.
+    for (const auto& [key, edge]: edges) {
+        const int a = key >> 32, b = key & 0xffffffff;
+        if (edge.first == 1) {
+            const std::array<int, 3>& face = faces[edge.second];
+            const PF3D n = (pos[face[1]] - pos[face[0]]).cross(pos[face[2]] - pos[face[0]]);
+            PF3D side = (pos[b] - pos[a]).cross(n);
+            if (side.norm() > 0) {
+                side.normalize();
+                const Quadric q = plane_quadric(pos[a], side, BOUNDARY_WEIGHT);
+                quadrics[a] += q;
+                quadrics[b] += q;
+            }
+        }
+        push_edge(a, b);
+    }
+}
+
+void Decimator::push_edge(int a, int b) {
+    // Best of the two ends and the midpoint. Avoids inverting the quadric.
+    const Quadric q = quadrics[a] + quadrics[b];
+    Collapse c;
+    c.a = a;
+    c.b = b;
+    c.version_a = version[a];
+    c.version_b = version[b];
+    c.cost = INFINITY;
+    for (const PF3D& p: {pos[a], pos[b], PF3D((pos[a] + pos[b]) / 2)}) {
+        const double cost = quadric_error(q, p);
+        if (cost < c.cost) {
+            c.cost = cost;
+            c.target = p;
+        }
+    }
+    heap.push(c);
+}
+
+bool Decimator::flips(int v, int other, const PF3D& p) {
+    for (int f: vert_faces[v]) {
+        if (!face_alive[f])
+            continue;
+        const std::array<int, 3>& face = faces[f];
+        if (face[0] == other || face[1] == other || face[2] == other)
+            continue;
+
+        PF3D before[3], after[3];
+        for (int k = 0; k < 3; k++) {
+            before[k] = pos[face[k]];
+            after[k] = (face[k] == v) ? p : pos[face[k]];
+        }
+        const PF3D n1 = (before[1] - before[0]).cross(before[2] - before[0]);
+        const PF3D n2 = (after[1] - after[0]).cross(after[2] - after[0]);
+        if (n1.dot(n2) <= 0)
+            return true;
+    }
+    return false;
+}
+
+bool Decimator::reduce(int target) {
+    while (num_faces > target) {
+        if (heap.empty())
+            return false;
+
+        const Collapse c = heap.top();
+        heap.pop();
+        if (!vert_alive[c.a] || !vert_alive[c.b] || version[c.a] != c.version_a || version[c.b] != c.version_b)
+            continue;
+        if (flips(c.a, c.b, c.target) || flips(c.b, c.a, c.target))
+            continue;
+
+        // Move b into a. Faces with both are removed, others now use a.
+        for (int f: vert_faces[c.b]) {
+            if (!face_alive[f])
+                continue;
+            std::array<int, 3>& face = faces[f];
+            if (face[0] == c.a || face[1] == c.a || face[2] == c.a) {
+                face_alive[f] = false;
+                num_faces--;
+            } else {
+                for (int k = 0; k < 3; k++) {
+                    if (face[k] == c.b)
+                        face[k] = c.a;
+                }
+                vert_faces[c.a].push_back(f);
+            }
+        }
+        vert_faces[c.b].clear();
+        vert_alive[c.b] = false;
+
+        pos[c.a] = c.target;
+        quadrics[c.a] += quadrics[c.b];
+        merged_into[c.b] = c.a;
+        version[c.a]++;
+
+        // Drop dead faces, then requeue edges around a.
+        std::vector<int>& around = vert_faces[c.a];
+        around.erase(std::remove_if(around.begin(), around.end(),
+            [this](int f) { return !face_alive[f]; }), around.end());
+        for (int f: around) {
+            for (int k = 0; k < 3; k++) {
+                if (faces[f][k] != c.a)
+                    push_edge(c.a, faces[f][k]);
+            }
+        }
+    }
+    return true;
+}
+
+int Decimator::find(int v) {
+    while (merged_into[v] != v) {
+        merged_into[v] = merged_into[merged_into[v]];
+        v = merged_into[v];
+    }
+    return v;
+}
+
+double Decimator::error() {
+    double max_dist = 0;
+    for (int v = 0; v < (int)original.size(); v++) {
+        double dist = INFINITY;
+        for (int f: vert_faces[find(v)]) {
+            if (!face_alive[f])
+                continue;
+            const std::array<int, 3>& face = faces[f];
+            dist = std::min(dist, point_tri_dist(original[v], pos[face[0]], pos[face[1]], pos[face[2]]));
+        }
+        if (dist < INFINITY)
+            max_dist = std::max(max_dist, dist);
+    }
+    return max_dist;
+}
+
+LodLevel Decimator::level() {
+    LodLevel out;
+    out.error = error();
+    out.indices.reserve(3*num_faces);
+
+    // Only copy vertices still used, in order of first use.
+    std::vector<int> remap(pos.size(), -1);
+    for (int f = 0; f < (int)faces.size(); f++) {
+        if (!face_alive[f])
+            continue;
+        for (int k = 0; k < 3; k++) {
+            int& id = remap[faces[f][k]];
+            if (id < 0) {
+                id = out.vertices.size() / 3;
+                for (int c = 0; c < 3; c++)
+                    out.vertices.push_back(pos[faces[f][k]](c));
+            }
+            out.indices.push_back(id);
+        }
+    }
+    out.vertices.shrink_to_fit();
+    return out;
+}
+
+
+void hash_face(uint64_t& hash, const Tri& tri) {
+    Hash::bytes(hash, tri.p1.data(), 3*sizeof(double));
+    Hash::bytes(hash, tri.p2.data(), 3*sizeof(double));
+    Hash::bytes(hash, tri.p3.data(), 3*sizeof(double));
+}
+
+/**
+ * Helper for build_lods.
+ * Hash of the positions of all faces.
+ */
+uint64_t hash_faces(const std::vector<Tri>& faces) {
+    uint64_t hash = Hash::START;
+    for (const Tri& tri: faces)
+        hash_face(hash, tri);
+    return hash;
+}
+
+void build_lods(Mesh& mesh) {
+    if (mesh._lod_built)
+        return;
+    mesh._lod_built = true;
+    mesh._lod_hash = hash_faces(mesh.faces);
+    mesh._lod_scale = {1, 1, 1};
+    mesh._lod_location = {0, 0, 0};
+    mesh.lods.clear();
+
+    // Bounding sphere around the center of the bounding box.
+    mesh._bound_center = {0, 0, 0};
+    mesh._bound_radius = 0;
+    if (mesh.faces.empty())
+        return;
+    PF3D lo = mesh.faces[0].p1, hi = mesh.faces[0].p1;
+    for (const Tri& tri: mesh.faces) {
+        for (const PF3D* p: {&tri.p1, &tri.p2, &tri.p3}) {
+            lo = lo.cwiseMin(*p);
+            hi = hi.cwiseMax(*p);
+        }
+    }
+    mesh._bound_center = (lo + hi) / 2;
+    mesh._bound_radius = (hi - lo).norm() / 2;
+
+    if ((int)mesh.faces.size() < LOD_MIN_FACES)
+        return;
+
+    // One decimation pass, keeping a snapshot every 4x fewer faces.
+    Decimator dec(mesh.faces);
+    for (int target = mesh.faces.size() / 4; target >= LOD_MIN_LEVEL_FACES; target /= 4) {
+        const int before = dec.num_faces;
+        const bool done = !dec.reduce(target);
+        if (dec.num_faces == before)
+            break;
+        mesh.lods.push_back(dec.level());
+        if (done)
+            break;
+    }
+}
+
+void build_lods(Scene& scene) {
+    parallel_for(0, scene.meshes.size(), [&](int i) {
+        build_lods(scene.meshes[i]);
+    });
+}
+
+void update_lods(Mesh& mesh, uint64_t before, uint64_t after, const PF3D& scale, const PF3D& location) {
+    if (!mesh._lod_built)
+        return;
+    if (before != mesh._lod_hash) {
+        mesh.lods.clear();
+        mesh._lod_faces.clear();
+        mesh._lod_built = false;
+        return;
+    }
+    mesh._lod_scale = mesh._lod_scale.cwiseProduct(scale);
+    mesh._lod_location = mesh._lod_location.cwiseProduct(scale) + location;
+    mesh._lod_hash = after;
+}
+
+
+int select_lod(Scene& scene, Mesh& mesh) {
+    // Bounds and errors are in lod space, scaled by the largest axis.
+    const double scale = mesh._lod_scale.cwiseAbs().maxCoeff();
+    const PF3D center = mesh._bound_center.cwiseProduct(mesh._lod_scale) + mesh._lod_location;
+    const double dist = (center - scene.cam.location).norm() - mesh._bound_radius*scale;
+    if (dist <= scene.clip_start)
+        return 0;
+
+    // Pixels per world unit at the closest point of the mesh.
+    const double px_per_unit = scene.width / (2 * tan(scene.cam.fov/2) * dist);
+    int level = 0;
+    for (int i = 0; i < (int)mesh.lods.size(); i++) {
+        if (mesh.lods[i].error * scale * px_per_unit <= scene.lod_error)
+            level = i + 1;
+    }
+    return level;
+}
+
+void expand_lod(Mesh& mesh, int level) {
+    mesh._lod_faces.clear();
+    if (level == 0) {
+        mesh._lod_faces.shrink_to_fit();
+        return;
+    }
+
+    const LodLevel& lod = mesh.lods[level-1];
+    auto vertex = [&](UINT i) {
+        const PF3D v(lod.vertices[3*i], lod.vertices[3*i+1], lod.vertices[3*i+2]);
+        return PF3D(v.cwiseProduct(mesh._lod_scale) + mesh._lod_location);
+    };
+    mesh._lod_faces.reserve(lod.indices.size() / 3);
+    for (size_t i = 0; i+3 <= lod.indices.size(); i += 3) {
+        mesh._lod_faces.push_back(Tri(vertex(lod.indices[i]), vertex(lod.indices[i+1]), vertex(lod.indices[i+2])));
+        get_normal(mesh._lod_faces.back().normal, mesh._lod_faces.back());
+    }
+}
+
+
+}  // namespace Quaternion
@@ -17,6 +17,7 @@
 //  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 //
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 
@@ -46,17 +47,71 @@ void preprocess_point(PF3D& point, Mesh& mesh) {
     point(2) += mesh.location(2);
 }
 
-void preprocess_mesh(Scene& scene, Mesh& mesh) {
+/**
+ * Fewest faces expand_indexed expands before freeing their indices.
+ */
+static const size_t EXPAND_CHUNK = 1 << 16;
+
+/**
+ * Helper for preprocess_mesh.
+ * Append indexed faces to mesh.faces and free the indexed buffers.
+ * Indices are freed in chunks of at least 1/8 of the rest as they are
+ * expanded, so they are not all held next to the expanded faces.
+ */
+template <typename T>
+void expand_indexed(Mesh& mesh, const std::vector<T>& vertices) {
+    const size_t num_verts = vertices.size() / 3;
+    auto vertex = [&](UINT i) {
+        if (i >= num_verts) {
+            std::cerr << "Quaternion::preprocess: Index out of range." << std::endl;
+            throw 1;
+        }
+        return PF3D(vertices[3*i], vertices[3*i+1], vertices[3*i+2]);
+    };
+
+    mesh.faces.reserve(mesh.faces.size() + mesh.indices.size()/3);
+    while (mesh.indices.size() >= 3) {
+        const size_t left = mesh.indices.size() / 3;
+        const size_t count = std::min(left, std::max(EXPAND_CHUNK, left/8));
+        const UINT* idx = mesh.indices.data();
+        for (size_t i = 0; i < 3*count; i += 3)
+            mesh.faces.push_back(Tri(vertex(idx[i]), vertex(idx[i+1]), vertex(idx[i+2])));
+        mesh.indices = std::vector<UINT>(mesh.indices.begin() + 3*count, mesh.indices.end());
+    }
+
+    mesh.vertices = std::vector<float>();
+    mesh.vertices_d = std::vector<double>();
+    mesh.indices = std::vector<UINT>();
+}
+
+void preprocess_mesh(Mesh& mesh) {
+    if (!mesh.indices.empty() && !mesh.vertices_d.empty())
+        expand_indexed(mesh, mesh.vertices_d);
+    else if (!mesh.indices.empty())
+        expand_indexed(mesh, mesh.vertices);
+
+    // Lods stay in the space they were built in and follow the transform.
+    // Faces are hashed in the same pass to detect edits, after baking only if moved.
+    const PF3D scale = mesh.scale, location = mesh.location;
+    const bool track = mesh._lod_built;
+    const bool moved = (scale != PF3D(1, 1, 1) || location != PF3D(0, 0, 0));
+    uint64_t before = Hash::START, after = Hash::START;
+
     for (int i = 0; i < (int)mesh.faces.size(); i++) {
         Tri& face = mesh.faces[i];
-        scene._fptrs.push_back(&face);
+        if (track)
+            hash_face(before, face);
         preprocess_point(face.p1, mesh);
         preprocess_point(face.p2, mesh);
         preprocess_point(face.p3, mesh);
         get_normal(face.normal, face);
+        if (track && moved)
+            hash_face(after, face);
     }
     mesh.location = {0, 0, 0};
     mesh.scale = {1, 1, 1};
+    if (track)
+        update_lods(mesh, before, moved ? after : before, scale, location);
 }
 
 
@@ -89,11 +144,31 @@ void preprocess_cam(Scene& scene, Camera& cam) {
 }
 
 
+/**
+ * Add the faces of the chosen level of detail to _fptrs.
+ */
+void add_faces(Scene& scene, Mesh& mesh, int id) {
+    const int level = (scene.lod_error > 0) ? select_lod(scene, mesh) : 0;
+    expand_lod(mesh, level);
+    std::vector<Tri>& faces = (level == 0) ? mesh.faces : mesh._lod_faces;
+    for (int i = 0; i < (int)faces.size(); i++) {
+        scene._fptrs.push_back(&faces[i]);
+        scene._mesh_ids.push_back(id);
+    }
+}
+
 void preprocess(Scene& scene) {
-    scene._fptrs.clear();
     for (int i = 0; i < (int)scene.meshes.size(); i++)
-        preprocess_mesh(scene, scene.meshes[i]);
+        preprocess_mesh(scene.meshes[i]);
     preprocess_cam(scene, scene.cam);
+
+    if (scene.lod_error > 0)
+        build_lods(scene);
+
+    scene._fptrs.clear();
+    scene._mesh_ids.clear();
+    for (int i = 0; i < (int)scene.meshes.size(); i++)
+        add_faces(scene, scene.meshes[i], i);
 }
 
 
@@ -19,7 +19,11 @@
 
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <istream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <Eigen/Dense>
@@ -71,12 +75,43 @@ namespace Random {
     double uniform(const double lower, const double upper);
 }
 
+namespace Hash {
+    /**
+     * Initial value of a hash.
+     */
+    const uint64_t START = 14695981039346656037ull;
+
+    /**
+     * Mix bytes into a hash. Not cryptographic.
+     */
+    void bytes(uint64_t& hash, const void* data, size_t size);
+
+    /**
+     * Spread the bits of a hash, so that sums of hashes are still
+     * well distributed.
+     */
+    uint64_t mix(uint64_t hash);
+}
+
+/**
+ * Call func(i) for every i in [begin, end), spread over threads.
+ * threads = 0 uses one thread per core.
+ * Calls may run in any order, so func must be safe to call concurrently.
+ * Threads are kept alive between calls. Nested calls run serially.
+ * If func throws, the remaining indices are skipped and the first exception
+ * is rethrown once all threads have stopped using func.
+ */
+void parallel_for(int begin, int end, const std::function<void(int)>& func, UINT threads = 0);
+
 
 // Image processing
 // Implementations in image.cpp
 
 /**
  * Image with three channels.
+ * Memory is 64 byte aligned, or a mapped file if requested.
+ * Copying makes a deep copy in memory. Moving leaves the other image
+ * empty (0 by 0, mem is nullptr).
  */
 struct Image {
     /**
@@ -86,13 +121,32 @@ struct Image {
 
     /**
      * Initialize with width and height (pixels).
+     * Throws:
+     * - 1 if memory cannot be allocated.
      */
     Image(int width, int height);
 
+    /**
+     * Initialize with width and height (pixels), stored in the file at
+     * path (created or resized, raw pixels like mem). Pages are read and
+     * written back by the OS as needed, so very large (16K+) images
+     * can exceed RAM. The file is kept after the image is destroyed.
+     * Throws:
+     * - 1 if the file cannot be opened or mapped.
+     */
+    Image(int width, int height, const std::string& path);
+
+    Image(const Image& other);
+    Image(Image&& other) noexcept;
+    Image& operator=(const Image& other);
+    Image& operator=(Image&& other) noexcept;
+
     /**
      * Index of byte to satisfy arguments.
      */
-    int mempos(int x, int y, int channel);
+    size_t mempos(int x, int y, int channel) const {
+        return ((size_t)y*width + x)*3 + channel;
+    }
 
     /**
      * Set all channels and pixels to 0.
@@ -103,20 +157,101 @@ struct Image {
      * Get value at (x, y) and channel.
      * Channel 0 is R, 1 is G, 2 is B.
      */
-    UCH get(int x, int y, int channel);
+    UCH get(int x, int y, int channel) const {
+        return mem[mempos(x, y, channel)];
+    }
 
     /**
      * Set value at (x, y) and channel.
      * Channel 0 is R, 1 is G, 2 is B.
      */
-    void set(int x, int y, int channel, UCH value);
+    void set(int x, int y, int channel, UCH value) {
+        mem[mempos(x, y, channel)] = value;
+    }
+
+    /**
+     * Get all channels at (x, y).
+     */
+    RGB get(int x, int y) const {
+        const UCH* px = mem + mempos(x, y, 0);
+        return RGB(px[0], px[1], px[2]);
+    }
+
+    /**
+     * Set all channels at (x, y).
+     */
+    void set(int x, int y, const RGB& color) {
+        UCH* px = mem + mempos(x, y, 0);
+        px[0] = color(0);
+        px[1] = color(1);
+        px[2] = color(2);
+    }
+
+    /**
+     * Pointer to the first byte of row y.
+     * The row is width * 3 bytes long.
+     */
+    UCH* row(int y) {
+        return mem + (size_t)y*width*3;
+    }
+
+    const UCH* row(int y) const {
+        return mem + (size_t)y*width*3;
+    }
+
+    /**
+     * Set every pixel to color.
+     */
+    void fill(const RGB& color);
+
+    /**
+     * Copy src into this image with its top left corner at (x, y).
+     * Parts outside this image are skipped.
+     */
+    void blit(const Image& src, int x, int y);
+
+    /**
+     * Average every factor * factor block into one pixel.
+     * Output size is (width / factor, height / factor).
+     * Throws:
+     * - 1 if factor is not positive.
+     */
+    Image downsample_box(int factor) const;
+
+    /**
+     * Downsample by factor with a Lanczos-3 filter.
+     * Output size is (width / factor, height / factor).
+     * Throws:
+     * - 1 if factor is not positive.
+     */
+    Image downsample_lanczos(int factor) const;
+
+    /**
+     * Reorder channels in place. New channel i is old channel ci.
+     * For example, swizzle(2, 1, 0) converts RGB to BGR.
+     * Throws:
+     * - 1 if a channel is not 0, 1 or 2.
+     */
+    void swizzle(int c0, int c1, int c2);
+
+    /**
+     * Convert to floats (value * scale), same layout as mem.
+     */
+    void to_float(std::vector<float>& dest, float scale = 1.0f/255.0f) const;
+
+    /**
+     * Set from floats (value * scale, clamped and rounded), same layout as mem.
+     * Throws:
+     * - 1 if src is smaller than width * height * 3.
+     */
+    void from_float(const std::vector<float>& src, float scale = 255.0f);
 
     /**
      * Write image as unstandardized binary format.
      * Recommended extension: .qif (quaternion image format).
      * See docs for more info.
      */
-    void write(std::string path);
+    void write(std::string path) const;
 
     /**
      * Size is width * height * 3
@@ -130,6 +265,12 @@ struct Image {
      * You can change these, but you shouldn't.
      */
     int width, height;
+
+    /**
+     * Whether mem is a mapped file, and the number of bytes allocated.
+     */
+    bool _mapped;
+    size_t _bytes;
 };
 
 
@@ -147,8 +288,6 @@ struct Tri {
 
     Tri(PF3D p1, PF3D p2, PF3D p3);
 
-    Tri(const Tri& other);
-
     PF3D p1, p2, p3;
 
     /**
@@ -159,12 +298,34 @@ struct Tri {
     PF3D normal;
 };
 
+/**
+ * Simplified version of a mesh. Indexed, so all levels together
+ * take a small fraction of the memory of the full faces.
+ */
+struct LodLevel {
+    /**
+     * 3 values (x, y, z) per vertex.
+     */
+    std::vector<float> vertices;
+
+    /**
+     * 3 vertex indices per face.
+     */
+    std::vector<UINT> indices;
+
+    /**
+     * Geometric error, in the space the level was built in.
+     */
+    double error;
+};
+
 /**
  * Mesh is a collection of triangles along with transformations.
  * Transformations are applied in this order:
  * - rotation (TODO)
  * - scale
  * - location
+ * Meshes are movable. Use std::move when adding large meshes to a scene.
  */
 struct Mesh {
     /**
@@ -172,13 +333,108 @@ struct Mesh {
      */
     Mesh();
 
-    Mesh(const Mesh& other);
+    /**
+     * Take ownership of faces without copying them.
+     */
+    explicit Mesh(std::vector<Tri>&& faces);
+
+    /**
+     * Take ownership of indexed vertices without copying them.
+     * Double vertices stay double, in vertices_d.
+     * Throws:
+     * - 1 if a buffer size is not a multiple of 3, or an index is out of range.
+     */
+    Mesh(std::vector<float>&& vertices, std::vector<UINT>&& indices);
+    Mesh(std::vector<double>&& vertices, std::vector<UINT>&& indices);
 
     std::vector<Tri> faces;
+
+    /**
+     * Indexed faces, added to faces by preprocess and then freed.
+     * 3 values (x, y, z) per vertex in vertices, or in vertices_d if it is
+     * not empty. 3 vertex indices per face.
+     * With about 2 faces per vertex this is 18 bytes per face (24 with
+     * double vertices), against 96 for faces. preprocess frees indices in
+     * chunks as it expands them, so its peak is about 96 bytes per face
+     * plus the vertices.
+     */
+    std::vector<float> vertices;
+    std::vector<double> vertices_d;
+    std::vector<UINT> indices;
+
     RGB color;
 
     PF3D location;
     PF3D scale;
+
+    // Set by preprocessor
+
+    /**
+     * Simplified versions of faces, each with about 1/4 the faces of the
+     * one before. Built by build_lods(), in the space faces were in then.
+     */
+    std::vector<LodLevel> lods;
+
+    /**
+     * Transform (scale, then location) from the space lods were built in to
+     * world space. Transforms baked into faces are added here, so moving
+     * a mesh does not rebuild its lods.
+     */
+    PF3D _lod_scale, _lod_location;
+
+    /**
+     * Whether lods are built, and the hash of faces after the last
+     * preprocess, to detect edits.
+     */
+    bool _lod_built;
+    uint64_t _lod_hash;
+
+    /**
+     * Bounding sphere of faces, in the space lods were built in.
+     */
+    PF3D _bound_center;
+    double _bound_radius;
+
+    /**
+     * The level picked for rendering, in world space.
+     * Empty if faces are used.
+     */
+    std::vector<Tri> _lod_faces;
+};
+
+/**
+ * Shape with a closed form ray intersection, rendered without triangles.
+ */
+struct Primitive {
+    enum Type {
+        SPHERE,
+        PLANE,
+        BOX,
+        CYLINDER,
+    };
+
+    /**
+     * Sphere with radius 1 at the origin.
+     */
+    Primitive();
+
+    Type type;
+
+    /**
+     * Center of the shape, or any point on a plane.
+     */
+    PF3D location;
+
+    /**
+     * Meaning depends on type:
+     * - Sphere: radius is size(0).
+     * - Plane: normal of the plane. Planes are infinite.
+     * - Box: side lengths. Boxes are axis aligned.
+     * - Cylinder: radius is size(0), height is size(2). Axis is Z.
+     */
+    PF3D size;
+
+    RGB color;
 };
 
 /**
@@ -215,6 +471,8 @@ struct Light {
 /**
  * Groups together meshes and a camera.
  * Pass this to the render function.
+ * Moving keeps the preprocessed data valid. A copy's _fptrs still point
+ * into the original until it is preprocessed again (render does this).
  */
 struct Scene {
     Scene();
@@ -229,7 +487,14 @@ struct Scene {
      */
     double clip_start, clip_end;
 
+    /**
+     * Max error in pixels allowed when picking a level of detail for
+     * each mesh. 0 (default) always uses the original faces.
+     */
+    double lod_error;
+
     std::vector<Mesh> meshes;
+    std::vector<Primitive> primitives;
     std::vector<Light> lights;
     Camera cam;
     RGB background;
@@ -249,13 +514,61 @@ struct Scene {
      * Easier indexing of faces.
      */
     std::vector<Tri*> _fptrs;
+
+    /**
+     * Index into meshes of the mesh each entry of _fptrs belongs to.
+     */
+    std::vector<int> _mesh_ids;
 };
 
+/**
+ * Build a mesh from caller owned buffers.
+ * verts has 3 values (x, y, z) per vertex. indices has 3 vertex indices per face.
+ * The buffers are copied once into the mesh's indexed storage, keeping
+ * the vertex type, and can be freed once this returns. Until then both
+ * copies are alive; the Mesh constructors that take vectors avoid this.
+ * Throws:
+ * - 1 if an index is out of range.
+ */
+Mesh mesh_from_buffers(const double* verts, size_t num_verts, const UINT* indices, size_t num_faces);
+Mesh mesh_from_buffers(const float* verts, size_t num_verts, const UINT* indices, size_t num_faces);
+
 /**
  * Create a cube mesh with side length size at the origin.
  */
 Mesh primitive_cube(double size);
 
+/**
+ * Analytic sphere at the origin.
+ */
+Primitive primitive_sphere(double radius);
+
+/**
+ * Analytic infinite plane through the origin.
+ */
+Primitive primitive_plane(PF3D normal);
+
+/**
+ * Analytic axis aligned box at the origin.
+ */
+Primitive primitive_box(PF3D size);
+
+/**
+ * Analytic capped cylinder at the origin, with its axis along Z.
+ */
+Primitive primitive_cylinder(double radius, double height);
+
+
+// Scene files
+// Implementations in scenefile.cpp
+
+/**
+ * Read a scene from text and add it to scene. See docs for the format.
+ * Throws:
+ * - 1 if the text is invalid.
+ */
+void read_scene(std::istream& in, Scene& scene);
+
 
 // Preprocessing
 // Implementations in preprocess.cpp
@@ -268,13 +581,180 @@ void get_normal(PF3D& dest, Tri& tri);
 /**
  * Preprocess the mesh (modifies it in place).
  * This will be called automatically. No need to call manually.
+ * - Add indexed faces (Mesh.vertices or Mesh.vertices_d, Mesh.indices) to faces.
  * - Apply transformations to each face.
  * - Calculate the normal of each face and store in Tri.normal
+ * - Build levels of detail if enabled, and pick one for each mesh.
  */
 void preprocess(Scene& scene);
 
 bool intersects(const PF3D, const PF3D, const Tri&);
 
+/**
+ * Intersect a ray (dir must be unit length) with a primitive.
+ * If hit at distance 0 < t < dist, sets dist and the unit normal and returns true.
+ */
+bool intersects(const PF3D& origin, const PF3D& dir, const Primitive& prim, double& dist, PF3D& normal);
+
+
+// Level of detail
+// Implementations in lod.cpp
+
+/**
+ * Build mesh.lods from mesh.faces with quadric edge collapse decimation.
+ * Meshes with few faces get no lods.
+ * Does nothing if lods are already built.
+ */
+void build_lods(Mesh& mesh);
+
+/**
+ * build_lods for every mesh, in parallel.
+ */
+void build_lods(Scene& scene);
+
+/**
+ * Add the positions of tri to hash. Used to detect edited faces.
+ */
+void hash_face(uint64_t& hash, const Tri& tri);
+
+/**
+ * Called by preprocess after baking scale and location into faces, with
+ * the hash_face() hash of all faces before and after baking.
+ * Drops lods if faces were edited since the last preprocess, otherwise
+ * applies the same transform to them.
+ */
+void update_lods(Mesh& mesh, uint64_t before, uint64_t after, const PF3D& scale, const PF3D& location);
+
+/**
+ * Pick the coarsest level whose error, projected at the mesh's distance
+ * from the camera, is within scene.lod_error pixels.
+ * Returns 0 for mesh.faces, or i+1 for mesh.lods[i].
+ */
+int select_lod(Scene& scene, Mesh& mesh);
+
+/**
+ * Store level (from select_lod) in mesh._lod_faces, in world space.
+ * Level 0 frees _lod_faces.
+ */
+void expand_lod(Mesh& mesh, int level);
+
+
+// Frame buffer
+// Implementations in framebuffer.cpp
+
+/**
+ * Arbitrary output variables stored in a FrameBuffer.
+ */
+enum AOV {
+    AOV_COLOR,
+    AOV_DEPTH,
+    AOV_NORMAL,
+    AOV_MESH_ID,
+    AOV_FACE_ID,
+    AOV_HITS,
+};
+
+/**
+ * Bit of an AOV in a FrameBuffer's aovs mask.
+ */
+inline int aov_bit(AOV aov) {
+    return 1 << aov;
+}
+
+/**
+ * Mask with every AOV.
+ */
+const int AOVS_ALL = (1 << (AOV_HITS+1)) - 1;
+
+/**
+ * Float accumulation buffer with one entry per pixel for each AOV.
+ * All AOVs are filled by the same trace.
+ * Samples are summed, not averaged, so tracing more samples into
+ * the same buffer refines it without discarding earlier work.
+ */
+struct FrameBuffer {
+    /**
+     * Initialize with width and height (pixels). All values are 0.
+     * aovs is a mask of aov_bit() values. Only those AOVs are allocated and
+     * traced, others stay empty. Hits and samples are always kept.
+     */
+    FrameBuffer(int width, int height, int aovs = AOVS_ALL);
+
+    /**
+     * Whether aov is stored in this buffer.
+     */
+    bool has(AOV aov) const;
+
+    /**
+     * Index of pixel (x, y) into the per pixel vectors.
+     * Multiply by 3 for color and normal.
+     */
+    int index(int x, int y);
+
+    /**
+     * Set all values to 0, and IDs to -1.
+     */
+    void clear();
+
+    /**
+     * Sum of colors (0 to 1) of all samples, including background.
+     * Size is width * height * 3, laid out like Image::mem.
+     */
+    std::vector<float> color;
+
+    /**
+     * Sum of distances to the closest face, over samples that hit a face.
+     */
+    std::vector<float> depth;
+
+    /**
+     * Sum of unit normals of hit faces, facing the camera.
+     * Size is width * height * 3.
+     */
+    std::vector<float> normal;
+
+    /**
+     * Mesh index and face index (into Scene._fptrs) of the closest hit
+     * over all samples. -1 if nothing was hit.
+     * Primitive i counts as mesh meshes.size() + i and face _fptrs.size() + i.
+     */
+    std::vector<int> mesh_id, face_id;
+
+    /**
+     * Number of samples that hit a face.
+     */
+    std::vector<UINT> hits;
+
+    /**
+     * Number of samples traced.
+     */
+    std::vector<UINT> samples;
+
+    /**
+     * Distance of the hit the IDs were taken from.
+     */
+    std::vector<float> _closest;
+
+    /**
+     * You can change these, but you shouldn't.
+     */
+    int width, height, aovs;
+};
+
+/**
+ * Convert an AOV to 8 bit and store in img.
+ * Values are scaled by exposure (color only) and clamped.
+ * - Color: average color.
+ * - Depth: 255 / average depth.
+ * - Normal: average normal, mapped from [-1, 1] to [0, 255].
+ * - Mesh and face ID: a distinct color for each ID.
+ * - Hits: fraction of samples that hit.
+ * Pixels with no hits are 0, except for color which has the background.
+ * Throws:
+ * - 1 if dimensions do not match, or aov is not in fb.
+ */
+void tonemap(FrameBuffer& fb, Image& img, AOV aov, double exposure = 1);
+
 
 // Rendering
 // Implementations in render.cpp
@@ -290,11 +770,196 @@ struct RenderSettings {
 };
 
 /**
- * Render the scene and store in img.
+ * Render a depth map of the scene and store in img.
+ * Only depth is traced. Pixels with no hits are set to 0.
  * Throws:
  * - 1 if dimensions do not match.
  */
 void render(Scene& scene, Image& img, RenderSettings& settings);
 
+/**
+ * Render the scene and add all AOVs to fb in one pass.
+ * Use tonemap() to get an image.
+ * Throws:
+ * - 1 if dimensions do not match.
+ */
+void render(Scene& scene, FrameBuffer& fb, RenderSettings& settings);
+
+/**
+ * Add all AOVs of pixels x_start <= x < x_end, y_start <= y < y_end to fb.
+ * Does not preprocess, so preprocess() must be called first.
+ */
+void render_region(Scene& scene, FrameBuffer& fb, RenderSettings& settings,
+    int x_start, int y_start, int x_end, int y_end);
+
+/**
+ * Render the scene progressively, for a fast preview.
+ * Passes are rendered at 1/16, 1/4, and full resolution. Each pass only traces
+ * pixels that earlier passes skipped, and the result is upsampled into img
+ * after every pass. Only pixels with no samples in fb are upsampled.
+ * Pixels with no hits are set to 0.
+ * Samples are accumulated into fb, so calling this again with the same
+ * fb adds settings.samples more samples to every pixel.
+ * callback (optional) is called with img and the pass index after each pass.
+ * Throws:
+ * - 1 if dimensions do not match, or fb has no depth.
+ */
+void render_progressive(Scene& scene, Image& img, FrameBuffer& fb, RenderSettings& settings,
+    std::function<void(Image&, int)> callback = nullptr);
+
+
+// Render cache
+// Implementations in cache.cpp
+
+/**
+ * Finished tiles of previous renders, keyed by a hash of everything that
+ * can change them: output size, camera, clipping, background, render
+ * settings, and the contents of every mesh and primitive whose screen
+ * space bounds overlap the tile.
+ * Only camera rays are traced, so nothing outside a tile's bounds affects it.
+ */
+struct RenderCache {
+    RenderCache();
+
+    /**
+     * Compute the key of every tile of the scene, row major.
+     * The scene must already be preprocessed.
+     */
+    std::vector<uint64_t> tile_keys(Scene& scene, RenderSettings& settings);
+
+    /**
+     * Remove tiles that were not used by the last render.
+     */
+    void prune();
+
+    /**
+     * Remove all tiles.
+     */
+    void clear();
+
+    /**
+     * Write tiles to a file. Format is unstandardized, like images.
+     * Returns false if the file cannot be written.
+     */
+    bool save(std::string path);
+
+    /**
+     * Add tiles from a file written by save().
+     * Returns false if the file cannot be read, was written by a different
+     * version of the library, or has a different tile_size.
+     */
+    bool load(std::string path);
+
+    /**
+     * Side length of a tile in pixels. Clear the cache after changing this.
+     */
+    int tile_size;
+
+    /**
+     * Pixels of each tile, laid out like Image::mem.
+     * Tiles at the right and bottom edges may be smaller.
+     */
+    std::unordered_map<uint64_t, std::vector<UCH>> tiles;
+
+    /**
+     * Keys used by the last render.
+     */
+    std::vector<uint64_t> _used;
+};
+
+/**
+ * Render a depth map of the scene and store in img, reusing tiles from
+ * cache when nothing they depend on has changed. New tiles are added to cache.
+ * Throws:
+ * - 1 if dimensions do not match.
+ */
+void render(Scene& scene, Image& img, RenderSettings& settings, RenderCache& cache);
+
+
+// Render server
+// Implementations in server.cpp
+
+/**
+ * Groups together settings for the render server.
+ */
+struct ServerSettings {
+    ServerSettings();
+
+    /**
+     * Path of the Unix domain socket.
+     */
+    std::string socket_path;
+
+    /**
+     * Approximate bytes of scenes and buffers to keep. Least recently used
+     * scenes are dropped past this.
+     */
+    size_t memory_budget;
+};
+
+/**
+ * Run a render server on a Unix domain socket. Never returns.
+ * Uploaded scenes are preprocessed once and kept with their buffers,
+ * so a render request only traces. See docs for the protocol.
+ * A stale socket at socket_path is replaced; any other file is left alone.
+ * Throws:
+ * - 1 if the socket cannot be created, or socket_path is not a socket.
+ */
+void serve(ServerSettings& settings);
+
+
+// Denoising
+// Implementations in denoise.cpp
+
+/**
+ * Groups together settings for denoising.
+ */
+struct DenoiseSettings {
+    DenoiseSettings();
+
+    /**
+     * Taps on each side of a pixel along an edge.
+     */
+    UINT radius;
+
+    /**
+     * Smallest color gradient (sum of channels, 0 to 1 scale, per pixel)
+     * treated as an edge. Pixels below it are left as is.
+     */
+    double threshold;
+
+    /**
+     * Smallest edge coherence (0 to 1) filtered. Lower values also
+     * filter corners, where there is no single edge direction.
+     */
+    double coherence;
+
+    /**
+     * Sigma (pixels) of the blur applied to gradients before
+     * estimating edge directions.
+     */
+    double sigma;
+
+    /**
+     * Threads to use, 0 for one per core.
+     */
+    UINT threads;
+};
+
+/**
+ * Edge directed denoiser for the color AOV.
+ * In this renderer noise comes from sub pixel coverage, so it sits on
+ * edges between objects and the background. The coverage of a straight
+ * edge is the same all along it, so each edge pixel is averaged with
+ * samples along the edge direction, estimated from the color gradient.
+ * Pixels away from edges are not changed.
+ * Filters fb.color in place. Run after rendering and before tonemap().
+ * Samples added afterwards are mixed with the filtered color, so denoise
+ * a copy of fb if it will be refined.
+ * Throws:
+ * - 1 if fb has no color.
+ */
+void denoise(FrameBuffer& fb, DenoiseSettings& settings);
+
 
 }  // namespace Quaternion
@@ -17,6 +17,7 @@
 //  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 //
 
+#include <cmath>
 #include <iostream>
 
 #include "quaternion.hpp"
@@ -78,6 +79,121 @@ void intersect_pt(PF3D& dest, const PF3D q1, const PF3D q2, const Tri& tri) {
 }
 
 
+/**
+ * Helper for intersects (primitive).
+ * Keep the closer of a new hit and the current one.
+ */
+bool closer_hit(double t, const PF3D& n, double& dist, PF3D& normal) {
+    if (t <= 1e-9 || t >= dist)
+        return false;
+    dist = t;
+    normal = n;
+    return true;
+}
+
+bool intersect_sphere(const PF3D& origin, const PF3D& dir, const Primitive& prim, double& dist, PF3D& normal) {
+    const double radius = prim.size(0);
+    const PF3D oc = origin - prim.location;
+    const double b = oc.dot(dir);
+    const double disc = b*b - (oc.dot(oc) - radius*radius);
+    if (disc < 0)
+        return false;
+
+    // Near root first, far root if the origin is inside.
+    const double root = sqrt(disc);
+    for (const double t: {-b - root, -b + root}) {
+        if (t > 1e-9)
+            return closer_hit(t, (oc + t*dir) / radius, dist, normal);
+    }
+    return false;
+}
+
+bool intersect_plane(const PF3D& origin, const PF3D& dir, const Primitive& prim, double& dist, PF3D& normal) {
+    const PF3D n = prim.size.normalized();
+    const double denom = n.dot(dir);
+    if (std::abs(denom) < 1e-12)
+        return false;
+    return closer_hit((prim.location - origin).dot(n) / denom, n, dist, normal);
+}
+
+bool intersect_box(const PF3D& origin, const PF3D& dir, const Primitive& prim, double& dist, PF3D& normal) {
+    // Slab test, tracking which axis the entry and exit are on.
+    double t_near = -INFINITY, t_far = INFINITY;
+    int near_axis = 0, far_axis = 0;
+    for (int a = 0; a < 3; a++) {
+        const double lo = prim.location(a) - prim.size(a)/2, hi = prim.location(a) + prim.size(a)/2;
+        if (std::abs(dir(a)) < 1e-12) {
+            if (origin(a) < lo || origin(a) > hi)
+                return false;
+            continue;
+        }
+        double t1 = (lo - origin(a)) / dir(a), t2 = (hi - origin(a)) / dir(a);
+        if (t1 > t2)
+            std::swap(t1, t2);
+        if (t1 > t_near) {
+            t_near = t1;
+            near_axis = a;
+        }
+        if (t2 < t_far) {
+            t_far = t2;
+            far_axis = a;
+        }
+    }
+    if (t_near > t_far)
+        return false;
+
+    const bool inside = t_near <= 1e-9;
+    const double t = inside ? t_far : t_near;
+    const int axis = inside ? far_axis : near_axis;
+    PF3D n(0, 0, 0);
+    n(axis) = (origin(axis) + t*dir(axis) > prim.location(axis)) ? 1 : -1;
+    return closer_hit(t, n, dist, normal);
+}
+
+bool intersect_cylinder(const PF3D& origin, const PF3D& dir, const Primitive& prim, double& dist, PF3D& normal) {
+    const double radius = prim.size(0), half = prim.size(2) / 2;
+    const PF3D oc = origin - prim.location;
+    bool hit = false;
+
+    // Side: circle in XY, then check Z range.
+    const double a = dir(0)*dir(0) + dir(1)*dir(1);
+    if (a > 1e-12) {
+        const double b = oc(0)*dir(0) + oc(1)*dir(1);
+        const double disc = b*b - a*(oc(0)*oc(0) + oc(1)*oc(1) - radius*radius);
+        if (disc >= 0) {
+            const double root = sqrt(disc);
+            for (const double t: {(-b - root) / a, (-b + root) / a}) {
+                const PF3D p = oc + t*dir;
+                if (std::abs(p(2)) <= half)
+                    hit |= closer_hit(t, PF3D(p(0), p(1), 0) / radius, dist, normal);
+            }
+        }
+    }
+
+    // Caps: planes at +-half, check radius.
+    if (std::abs(dir(2)) > 1e-12) {
+        for (const double z: {-half, half}) {
+            const double t = (z - oc(2)) / dir(2);
+            const PF3D p = oc + t*dir;
+            if (p(0)*p(0) + p(1)*p(1) <= radius*radius)
+                hit |= closer_hit(t, PF3D(0, 0, (z > 0) ? 1 : -1), dist, normal);
+        }
+    }
+
+    return hit;
+}
+
+bool intersects(const PF3D& origin, const PF3D& dir, const Primitive& prim, double& dist, PF3D& normal) {
+    switch (prim.type) {
+        case Primitive::SPHERE:    return intersect_sphere(origin, dir, prim, dist, normal);
+        case Primitive::PLANE:     return intersect_plane(origin, dir, prim, dist, normal);
+        case Primitive::BOX:       return intersect_box(origin, dir, prim, dist, normal);
+        case Primitive::CYLINDER:  return intersect_cylinder(origin, dir, prim, dist, normal);
+    }
+    return false;
+}
+
+
 /**
  * Closest distance between a line and a point.
  * From https://mathworld.wolfram.com/Point-LineDistance3-Dimensional.html
@@ -90,48 +206,148 @@ double closest_dist(Line& line, PF3D point) {
 }
 
 
-void render_px(Scene& scene, Image& img, RenderSettings& settings, int x, int y) {
+/**
+ * Result of tracing one sample.
+ */
+struct Hit {
+    /**
+     * Index into Scene._fptrs, or _fptrs.size() + i for primitive i.
+     * -1 if nothing was hit.
+     */
+    int face;
+
+    /**
+     * Index into Scene.meshes, or meshes.size() + i for primitive i.
+     */
+    int mesh;
+
+    double dist;
+
+    /**
+     * Unit normal of the face, facing the camera.
+     */
+    PF3D normal;
+
+    /**
+     * Unit direction of the ray.
+     */
+    PF3D dir;
+};
+
+/**
+ * Trace one sample through a random point in pixel (x, y).
+ */
+Hit trace_sample(Scene& scene, int x, int y) {
     const double clip_end = scene.clip_end;
     const PF3D cam_loc = scene.cam.location;
 
-    bool intersect = false;  // whether there was any intersect
-    double total_dist = 0;   // total distance of closest face from all samples
-    for (int s = 0; s < (int)settings.samples; s++) {
-        const _4F& lims = scene._angle_limits[y*scene.width + x];
-        const double x_angle = Random::uniform(lims.a, lims.b);
-        const double y_angle = Random::uniform(lims.c, lims.d);
-        Line ray(cam_loc, {tanf(x_angle), 1, tanf(y_angle)});
-
-        const PF3D q1 = ray.point;
-        const PF3D q2 = ray.point + 2*clip_end*ray.dir;
-
-        Tri* face_ind = nullptr;
-        double min_dist = clip_end;
-        for (int i = 0; i < (int)scene._fptrs.size(); i++) {
-            Tri& tri = *scene._fptrs[i];
-            if (intersects(q1, q2, tri)) {
-                PF3D inter;
-                intersect_pt(inter, q1, q2, tri);
-                const double dist = hypot(inter(0)-cam_loc(0), inter(1)-cam_loc(1), inter(2)-cam_loc(2));
-                if (dist < min_dist) {
-                    min_dist = dist;
-                    face_ind = &tri;
-                }
+    const _4F& lims = scene._angle_limits[y*scene.width + x];
+    const double x_angle = Random::uniform(lims.a, lims.b);
+    const double y_angle = Random::uniform(lims.c, lims.d);
+    Line ray(cam_loc, {tanf(x_angle), 1, tanf(y_angle)});
+
+    const PF3D q1 = ray.point;
+    const PF3D q2 = ray.point + 2*clip_end*ray.dir;
+
+    Hit hit;
+    hit.face = -1;
+    hit.dist = clip_end;
+    hit.dir = ray.dir.normalized();
+    for (int i = 0; i < (int)scene._fptrs.size(); i++) {
+        Tri& tri = *scene._fptrs[i];
+        if (intersects(q1, q2, tri)) {
+            PF3D inter;
+            intersect_pt(inter, q1, q2, tri);
+            const double dist = hypot(inter(0)-cam_loc(0), inter(1)-cam_loc(1), inter(2)-cam_loc(2));
+            if (dist < hit.dist) {
+                hit.dist = dist;
+                hit.face = i;
+                hit.mesh = scene._mesh_ids[i];
             }
         }
+    }
+    if (hit.face >= 0)
+        hit.normal = scene._fptrs[hit.face]->normal.normalized();
 
-        if (face_ind != nullptr) {
-            intersect = true;
-            total_dist += min_dist;
+    // Primitives are intersected directly, in the same loop over the ray.
+    const int num_faces = scene._fptrs.size(), num_meshes = scene.meshes.size();
+    for (int i = 0; i < (int)scene.primitives.size(); i++) {
+        if (intersects(cam_loc, hit.dir, scene.primitives[i], hit.dist, hit.normal)) {
+            hit.face = num_faces + i;
+            hit.mesh = num_meshes + i;
         }
     }
 
-    if (intersect) {
-        const UCH v = 255.0 / total_dist * settings.samples;
-        img.set(x, y, 0, v);
-        img.set(x, y, 1, v);
-        img.set(x, y, 2, v);
+    if (hit.face >= 0 && hit.normal.dot(hit.dir) > 0)
+        hit.normal *= -1;
+    return hit;
+}
+
+
+/**
+ * Trace samples through pixel (x, y) and add them to every AOV of the buffer.
+ */
+void accumulate_px(Scene& scene, FrameBuffer& fb, UINT samples, int x, int y) {
+    const int i = fb.index(x, y);
+    const bool color = !fb.color.empty(), depth = !fb.depth.empty(), normal = !fb.normal.empty();
+    const bool ids = !fb._closest.empty();
+    for (int s = 0; s < (int)samples; s++) {
+        const Hit hit = trace_sample(scene, x, y);
+
+        if (hit.face < 0) {
+            if (color) {
+                for (int c = 0; c < 3; c++)
+                    fb.color[3*i+c] += scene.background(c) / 255.0f;
+            }
+            continue;
+        }
+
+        // Facing ratio shading of the mesh or primitive color.
+        const int mesh = hit.mesh;
+        if (color) {
+            const int num_meshes = scene.meshes.size();
+            const RGB& rgb = (mesh < num_meshes) ? scene.meshes[mesh].color : scene.primitives[mesh-num_meshes].color;
+            const double facing = -hit.normal.dot(hit.dir);
+            for (int c = 0; c < 3; c++)
+                fb.color[3*i+c] += rgb(c) / 255.0 * facing;
+        }
+        if (normal) {
+            for (int c = 0; c < 3; c++)
+                fb.normal[3*i+c] += hit.normal(c);
+        }
+        if (depth)
+            fb.depth[i] += hit.dist;
+        fb.hits[i]++;
+
+        if (ids && (hit.dist < fb._closest[i] || fb.hits[i] == 1)) {
+            fb._closest[i] = hit.dist;
+            if (!fb.mesh_id.empty())
+                fb.mesh_id[i] = mesh;
+            if (!fb.face_id.empty())
+                fb.face_id[i] = hit.face;
+        }
     }
+    fb.samples[i] += samples;
+}
+
+void render(Scene& scene, FrameBuffer& fb, RenderSettings& settings) {
+    if (fb.width != scene.width || fb.height != scene.height) {
+        std::cerr << "Quaternion::render: Dimensions must match." << std::endl;
+        throw 1;
+    }
+
+    preprocess(scene);
+    render_region(scene, fb, settings, 0, 0, scene.width, scene.height);
+}
+
+void render_region(Scene& scene, FrameBuffer& fb, RenderSettings& settings,
+        int x_start, int y_start, int x_end, int y_end) {
+    // Rows are independent, every pixel is written by one thread.
+    parallel_for(y_start, y_end, [&](int y) {
+        for (int x = x_start; x < x_end; x++) {
+            accumulate_px(scene, fb, settings.samples, x, y);
+        }
+    });
 }
 
 void render(Scene& scene, Image& img, RenderSettings& settings) {
@@ -140,14 +356,59 @@ void render(Scene& scene, Image& img, RenderSettings& settings) {
         throw 1;
     }
 
-    preprocess(scene);
+    FrameBuffer fb(scene.width, scene.height, aov_bit(AOV_DEPTH));
+    render(scene, fb, settings);
+    tonemap(fb, img, AOV_DEPTH);
+}
+
 
-    for (int y = 0; y < scene.height; y++) {
-        for (int x = 0; x < scene.width; x++) {
-            render_px(scene, img, settings, x, y);
+/**
+ * Copy the top left pixel of every step * step block to the pixels
+ * of the block that have no samples yet. Pixels refined by an earlier
+ * call keep their own value.
+ */
+void upsample(Image& img, FrameBuffer& fb, int step) {
+    for (int y = 0; y < img.height; y++) {
+        for (int x = 0; x < img.width; x++) {
+            if (fb.samples[fb.index(x, y)] == 0)
+                img.set(x, y, img.get(x - x%step, y - y%step));
         }
     }
 }
 
+void render_progressive(Scene& scene, Image& img, FrameBuffer& fb, RenderSettings& settings,
+        std::function<void(Image&, int)> callback) {
+    if (img.width != scene.width || img.height != scene.height
+            || fb.width != scene.width || fb.height != scene.height) {
+        std::cerr << "Quaternion::render_progressive: Dimensions must match." << std::endl;
+        throw 1;
+    }
+
+    preprocess(scene);
+
+    // Pixel steps of each pass. Every grid contains the previous one.
+    const int steps[3] = {4, 2, 1};
+    for (int pass = 0; pass < 3; pass++) {
+        const int step = steps[pass];
+        const int prev = 2 * step;
+
+        parallel_for(0, (scene.height + step - 1) / step, [&](int row) {
+            const int y = row * step;
+            for (int x = 0; x < scene.width; x += step) {
+                // Already traced by a coarser pass, reuse those samples.
+                if (pass > 0 && x%prev == 0 && y%prev == 0)
+                    continue;
+                accumulate_px(scene, fb, settings.samples, x, y);
+            }
+        });
+
+        tonemap(fb, img, AOV_DEPTH);
+        if (step > 1)
+            upsample(img, fb, step);
+        if (callback)
+            callback(img, pass);
+    }
+}
+
 
 }  // namespace Quaternion
@@ -0,0 +1,141 @@
+//
+//  Quaternion
+//  3D raytracer.
+//  Copyright Patrick Huang 2021
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+
+#include <climits>
+#include <iostream>
+#include <sstream>
+
+#include "quaternion.hpp"
+
+
+namespace Quaternion {
+
+
+/**
+ * Helper for read_scene.
+ * Read a number of values from a line, or throw.
+ */
+template <typename T>
+void read_values(std::istringstream& line, int line_num, T* dest, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!(line >> dest[i])) {
+            std::cerr << "Quaternion::read_scene: Bad values on line " << line_num << "." << std::endl;
+            throw 1;
+        }
+    }
+}
+
+PF3D read_point(std::istringstream& line, int line_num) {
+    double v[3];
+    read_values(line, line_num, v, 3);
+    return PF3D(v[0], v[1], v[2]);
+}
+
+RGB read_color(std::istringstream& line, int line_num) {
+    int v[3];
+    read_values(line, line_num, v, 3);
+    return RGB(v[0], v[1], v[2]);
+}
+
+
+void read_scene(std::istream& in, Scene& scene) {
+    Mesh* mesh = nullptr;  // mesh that tri, location and scale apply to
+    std::string text;
+    for (int line_num = 1; std::getline(in, text); line_num++) {
+        std::istringstream line(text);
+        std::string cmd;
+        if (!(line >> cmd) || cmd[0] == '#')
+            continue;
+
+        if (cmd == "size") {
+            read_values(line, line_num, &scene.width, 1);
+            read_values(line, line_num, &scene.height, 1);
+            // Buffers are indexed with int.
+            if (scene.width <= 0 || scene.height <= 0 || (size_t)scene.width*scene.height*3 > INT_MAX) {
+                std::cerr << "Quaternion::read_scene: Bad size on line " << line_num << "." << std::endl;
+                throw 1;
+            }
+        } else if (cmd == "clip") {
+            read_values(line, line_num, &scene.clip_start, 1);
+            read_values(line, line_num, &scene.clip_end, 1);
+        } else if (cmd == "lod_error") {
+            read_values(line, line_num, &scene.lod_error, 1);
+        } else if (cmd == "background") {
+            scene.background = read_color(line, line_num);
+        } else if (cmd == "camera") {
+            scene.cam.location = read_point(line, line_num);
+            read_values(line, line_num, &scene.cam.fov, 1);
+        } else if (cmd == "light") {
+            Light light(read_point(line, line_num));
+            read_values(line, line_num, &light.power, 1);
+            scene.lights.push_back(light);
+        } else if (cmd == "mesh") {
+            scene.meshes.push_back(Mesh());
+            mesh = &scene.meshes.back();
+            mesh->color = read_color(line, line_num);
+        } else if (cmd == "cube" || cmd == "tri" || cmd == "location" || cmd == "scale") {
+            if (mesh == nullptr) {
+                std::cerr << "Quaternion::read_scene: " << cmd << " before mesh on line " << line_num << "." << std::endl;
+                throw 1;
+            }
+            if (cmd == "cube") {
+                double size;
+                read_values(line, line_num, &size, 1);
+                const std::vector<Tri> faces = primitive_cube(size).faces;
+                mesh->faces.insert(mesh->faces.end(), faces.begin(), faces.end());
+            } else if (cmd == "tri") {
+                const PF3D p1 = read_point(line, line_num);
+                const PF3D p2 = read_point(line, line_num);
+                const PF3D p3 = read_point(line, line_num);
+                mesh->faces.push_back(Tri(p1, p2, p3));
+            } else if (cmd == "location") {
+                mesh->location = read_point(line, line_num);
+            } else {
+                mesh->scale = read_point(line, line_num);
+            }
+        } else if (cmd == "sphere" || cmd == "plane" || cmd == "box" || cmd == "cylinder") {
+            // Location, then shape parameters, then color.
+            const PF3D location = read_point(line, line_num);
+            Primitive prim;
+            if (cmd == "sphere") {
+                double radius;
+                read_values(line, line_num, &radius, 1);
+                prim = primitive_sphere(radius);
+            } else if (cmd == "plane") {
+                prim = primitive_plane(read_point(line, line_num));
+            } else if (cmd == "box") {
+                prim = primitive_box(read_point(line, line_num));
+            } else {
+                double size[2];
+                read_values(line, line_num, size, 2);
+                prim = primitive_cylinder(size[0], size[1]);
+            }
+            prim.location = location;
+            prim.color = read_color(line, line_num);
+            scene.primitives.push_back(prim);
+        } else {
+            std::cerr << "Quaternion::read_scene: Unknown command " << cmd << " on line " << line_num << "." << std::endl;
+            throw 1;
+        }
+    }
+}
+
+
+}  // namespace Quaternion
@@ -0,0 +1,375 @@
+//
+//  Quaternion
+//  3D raytracer.
+//  Copyright Patrick Huang 2021
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "quaternion.hpp"
+
+
+namespace Quaternion {
+
+
+/**
+ * Largest scene text accepted by SCENE.
+ */
+static const size_t MAX_SCENE_BYTES = (size_t)1 << 28;
+
+/**
+ * Longest command line. Longer lines close the connection.
+ */
+static const size_t MAX_LINE = 4096;
+
+/**
+ * Bounds of the wait in milliseconds after accept fails.
+ */
+static const int ACCEPT_BACKOFF_MIN = 10;
+static const int ACCEPT_BACKOFF_MAX = 1000;
+
+
+ServerSettings::ServerSettings() {
+    socket_path = "/tmp/quaternion.sock";
+    memory_budget = (size_t)1 << 30;
+}
+
+
+/**
+ * Prepared scene with buffers to render it into.
+ */
+struct SceneEntry {
+    SceneEntry(Scene&& scene);
+
+    Scene scene;
+    FrameBuffer fb;
+    Image img;
+
+    /**
+     * Approximate memory used.
+     */
+    size_t bytes;
+
+    /**
+     * Held while rendering, since the buffers are reused.
+     */
+    std::mutex mutex;
+};
+
+SceneEntry::SceneEntry(Scene&& scene) : scene(std::move(scene)),
+        fb(this->scene.width, this->scene.height), img(this->scene.width, this->scene.height) {
+    Scene& s = this->scene;
+    preprocess(s);
+
+    bytes = sizeof(SceneEntry) + img._bytes;
+    for (const Mesh& mesh: s.meshes) {
+        bytes += (mesh.faces.size() + mesh._lod_faces.size()) * sizeof(Tri);
+        for (const LodLevel& lod: mesh.lods)
+            bytes += (lod.vertices.size() + lod.indices.size()) * 4;
+    }
+    bytes += s.primitives.size() * sizeof(Primitive);
+    bytes += s._angle_limits.size() * sizeof(_4F);
+    bytes += s._fptrs.size() * (sizeof(Tri*) + sizeof(int));
+    bytes += (fb.color.size() + fb.depth.size() + fb.normal.size() + fb._closest.size()) * sizeof(float);
+    bytes += (fb.mesh_id.size() + fb.face_id.size()) * sizeof(int);
+    bytes += (fb.hits.size() + fb.samples.size()) * sizeof(UINT);
+}
+
+
+/**
+ * Scenes by name, dropped least recently used first past the memory budget.
+ * Entries are shared, so a scene that is dropped while rendering stays
+ * alive until the render finishes.
+ */
+struct SceneStore {
+    SceneStore(size_t budget);
+
+    std::shared_ptr<SceneEntry> get(const std::string& name);
+    void put(const std::string& name, std::shared_ptr<SceneEntry> entry);
+    void drop(const std::string& name);
+
+    std::mutex mutex;
+    std::list<std::string> order;  // most recent first
+    std::unordered_map<std::string, std::pair<std::shared_ptr<SceneEntry>, std::list<std::string>::iterator>> entries;
+    size_t total, budget;
+};
+
+SceneStore::SceneStore(size_t budget) {
+    total = 0;
+    this->budget = budget;
+}
+
+std::shared_ptr<SceneEntry> SceneStore::get(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(name);
+    if (it == entries.end())
+        return nullptr;
+    order.splice(order.begin(), order, it->second.second);
+    return it->second.first;
+}
+
+void SceneStore::put(const std::string& name, std::shared_ptr<SceneEntry> entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Replace under the same lock, so no other put sees the name missing.
+    auto old = entries.find(name);
+    if (old != entries.end()) {
+        total -= old->second.first->bytes;
+        order.erase(old->second.second);
+        entries.erase(old);
+    }
+    order.push_front(name);
+    entries[name] = {entry, order.begin()};
+    total += entry->bytes;
+
+    // Never drop the newest scene, even if it is over budget alone.
+    while (total > budget && order.size() > 1) {
+        auto it = entries.find(order.back());
+        if (it != entries.end()) {
+            total -= it->second.first->bytes;
+            entries.erase(it);
+        }
+        order.pop_back();
+    }
+}
+
+void SceneStore::drop(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(name);
+    if (it == entries.end())
+        return;
+    total -= it->second.first->bytes;
+    order.erase(it->second.second);
+    entries.erase(it);
+}
+
+
+/**
+ * Helpers for handle_client.
+ * Socket IO. Return false if the connection is closed.
+ */
+bool read_line(int fd, std::string& line) {
+    line.clear();
+    char c;
+    while (true) {
+        if (recv(fd, &c, 1, 0) != 1)
+            return false;
+        if (c == '\n')
+            return true;
+        if (line.size() >= MAX_LINE)
+            return false;
+        line += c;
+    }
+}
+
+bool read_bytes(int fd, char* dest, size_t size) {
+    while (size > 0) {
+        const ssize_t n = recv(fd, dest, size, 0);
+        if (n <= 0)
+            return false;
+        dest += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_bytes(int fd, const char* src, size_t size) {
+    while (size > 0) {
+        const ssize_t n = send(fd, src, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        src += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_line(int fd, const std::string& line) {
+    return write_bytes(fd, (line + "\n").c_str(), line.size() + 1);
+}
+
+/**
+ * Helper for handle_client.
+ * AOV from its name, or false if there is none.
+ */
+bool parse_aov(const std::string& name, AOV& aov) {
+    const std::pair<const char*, AOV> names[] = {
+        {"color", AOV_COLOR}, {"depth", AOV_DEPTH}, {"normal", AOV_NORMAL},
+        {"mesh_id", AOV_MESH_ID}, {"face_id", AOV_FACE_ID}, {"hits", AOV_HITS},
+    };
+    for (const auto& [n, a]: names) {
+        if (name == n) {
+            aov = a;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Answer commands from one connection until it closes.
+ * A command that fails replies ERR, the server and connection stay up.
+ */
+void handle_client(int fd, SceneStore& store) {
+    std::string line;
+    while (read_line(fd, line)) {
+        std::istringstream args(line);
+        std::string cmd, name;
+        args >> cmd >> name;
+
+        try {
+            if (cmd == "SCENE") {
+                size_t size;
+                if (!(args >> size)) {
+                    write_line(fd, "ERR missing size");
+                    continue;
+                }
+                if (size > MAX_SCENE_BYTES) {
+                    // The scene text would be read as commands, so hang up.
+                    write_line(fd, "ERR scene too large");
+                    break;
+                }
+                std::string text(size, '\0');
+                if (!read_bytes(fd, text.data(), size))
+                    break;
+
+                Scene scene;
+                try {
+                    std::istringstream in(text);
+                    read_scene(in, scene);
+                } catch (int) {
+                    write_line(fd, "ERR invalid scene");
+                    continue;
+                }
+                store.put(name, std::make_shared<SceneEntry>(std::move(scene)));
+                write_line(fd, "OK");
+
+            } else if (cmd == "RENDER") {
+                RenderSettings settings;
+                std::string aov_name = "depth";
+                AOV aov;
+                long long samples;
+                if (!(args >> samples) || samples <= 0 || samples > UINT32_MAX) {
+                    write_line(fd, "ERR bad samples");
+                    continue;
+                }
+                settings.samples = samples;
+                args >> aov_name;
+                if (!parse_aov(aov_name, aov)) {
+                    write_line(fd, "ERR unknown aov");
+                    continue;
+                }
+                std::shared_ptr<SceneEntry> entry = store.get(name);
+                if (entry == nullptr) {
+                    write_line(fd, "ERR no scene " + name);
+                    continue;
+                }
+
+                // Already preprocessed, so only trace.
+                std::lock_guard<std::mutex> lock(entry->mutex);
+                Scene& scene = entry->scene;
+                entry->fb.clear();
+                render_region(scene, entry->fb, settings, 0, 0, scene.width, scene.height);
+                tonemap(entry->fb, entry->img, aov);
+
+                // Same layout as a .qif file.
+                const Image& img = entry->img;
+                const size_t size = sizeof(img.width) + sizeof(img.height) + (size_t)img.width*img.height*3;
+                if (!write_line(fd, "OK " + std::to_string(size))
+                        || !write_bytes(fd, (const char*)&img.width, sizeof(img.width))
+                        || !write_bytes(fd, (const char*)&img.height, sizeof(img.height))
+                        || !write_bytes(fd, (const char*)img.mem, (size_t)img.width*img.height*3))
+                    break;
+
+            } else if (cmd == "DROP") {
+                store.drop(name);
+                write_line(fd, "OK");
+
+            } else if (cmd == "QUIT") {
+                break;
+
+            } else {
+                write_line(fd, "ERR unknown command");
+            }
+        } catch (int) {
+            write_line(fd, "ERR failed");
+        } catch (const std::exception& e) {
+            write_line(fd, std::string("ERR ") + e.what());
+        }
+    }
+    close(fd);
+}
+
+
+void serve(ServerSettings& settings) {
+    const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (server < 0 || settings.socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Quaternion::serve: Could not create socket." << std::endl;
+        throw 1;
+    }
+    strcpy(addr.sun_path, settings.socket_path.c_str());
+
+    // Only replace a stale socket, never another kind of file.
+    struct stat st;
+    if (lstat(settings.socket_path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            close(server);
+            std::cerr << "Quaternion::serve: " << settings.socket_path << " exists and is not a socket." << std::endl;
+            throw 1;
+        }
+        unlink(settings.socket_path.c_str());
+    }
+    if (bind(server, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, 16) < 0) {
+        std::cerr << "Quaternion::serve: Could not bind " << settings.socket_path << "." << std::endl;
+        throw 1;
+    }
+
+    // Back off while accept keeps failing (e.g. out of file descriptors).
+    SceneStore store(settings.memory_budget);
+    int backoff_ms = 0;
+    while (true) {
+        const int client = accept(server, nullptr, nullptr);
+        if (client >= 0) {
+            backoff_ms = 0;
+            std::thread(handle_client, client, std::ref(store)).detach();
+        } else if (errno != EINTR) {
+            backoff_ms = std::min(std::max(2*backoff_ms, ACCEPT_BACKOFF_MIN), ACCEPT_BACKOFF_MAX);
+            std::cerr << "Quaternion::serve: accept failed: " << strerror(errno) << "." << std::endl;
+            std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+        }
+    }
+}
+
+
+}  // namespace Quaternion
@@ -0,0 +1,39 @@
+//
+//  Quaternion
+//  3D raytracer.
+//  Copyright Patrick Huang 2021
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+
+
+/**
+ * Render server executable.
+ * Usage: quaternion_server [socket_path] [memory_budget_mb]
+ */
+
+#include <cstdlib>
+
+#include "quaternion.hpp"
+
+
+int main(int argc, char** argv) {
+    Quaternion::ServerSettings settings;
+    if (argc > 1)
+        settings.socket_path = argv[1];
+    if (argc > 2)
+        settings.memory_budget = (size_t)atol(argv[2]) << 20;
+
+    Quaternion::serve(settings);
+}
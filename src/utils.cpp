@@ -17,6 +17,14 @@
 //  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 //
 
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <random>
+#include <thread>
+
 #include "quaternion.hpp"
 
 
@@ -53,9 +61,185 @@ double hypot(const double dx, const double dy, const double dz) {
 
 namespace Random {
     double uniform(const double lower, const double upper) {
-        const double num = ((double)rand())/1e9 + (double)rand();
-        return lower + fmod(num, upper-lower);
+        // One generator per thread, so parallel renders do not share state.
+        thread_local std::mt19937_64 gen(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        return lower + (upper-lower) * std::generate_canonical<double, 53>(gen);
+    }
+}
+
+
+namespace Hash {
+    void bytes(uint64_t& hash, const void* data, size_t size) {
+        // 8 byte words, each fully mixed so every bit affects the whole hash.
+        // Then the remaining bytes with FNV-1a.
+        const uint64_t prime = 1099511628211ull;
+        const UCH* mem = (const UCH*)data;
+        size_t i = 0;
+        for (; i+8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, mem+i, 8);
+            hash = mix(hash ^ word) * prime;
+        }
+        for (; i < size; i++)
+            hash = (hash ^ mem[i]) * prime;
+    }
+
+    uint64_t mix(uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+}
+
+
+/**
+ * Worker threads shared by every parallel_for. Started on first use and
+ * kept alive, so later calls do not pay for creating threads.
+ * Runs one job at a time. Every worker acknowledges every job, so no
+ * worker can still be running a job after parallel_for returns.
+ */
+struct ThreadPool {
+    ThreadPool();
+    ~ThreadPool();
+
+    void work(UINT index);
+    void take(const std::function<void(int)>& func);
+    void run(int begin, int end, const std::function<void(int)>& func, UINT threads);
+
+    std::vector<std::thread> workers;
+
+    /**
+     * Held by the caller for a whole job.
+     */
+    std::mutex job_mutex;
+
+    /**
+     * Guards the fields below.
+     */
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    uint64_t generation;
+    UINT finished;
+    bool stop;
+
+    const std::function<void(int)>* func;
+    std::atomic<int> next;
+    int end;
+    UINT participants;
+
+    /**
+     * First exception thrown by func in this job, rethrown by run.
+     */
+    std::exception_ptr error;
+};
+
+/**
+ * True on pool threads, and on the caller while it runs a job.
+ * Nested parallel_for calls run serially there.
+ */
+thread_local bool in_pool = false;
+
+ThreadPool::ThreadPool() {
+    generation = 0;
+    finished = 0;
+    stop = false;
+    func = nullptr;
+    end = 0;
+    participants = 0;
+
+    const UINT cores = std::max(1u, std::thread::hardware_concurrency());
+    for (UINT i = 0; i+1 < cores; i++)
+        workers.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (std::thread& t: workers)
+        t.join();
+}
+
+void ThreadPool::work(UINT index) {
+    in_pool = true;
+    uint64_t seen = 0;
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&]() { return stop || generation != seen; });
+        if (stop)
+            return;
+        seen = generation;
+        lock.unlock();
+
+        if (index < participants)
+            take(*func);
+
+        lock.lock();
+        if (++finished == workers.size())
+            done.notify_all();
+    }
+}
+
+/**
+ * Run indices of the current job until none are left.
+ * If func throws, the rest of the job is skipped and the exception kept.
+ */
+void ThreadPool::take(const std::function<void(int)>& func) {
+    try {
+        for (int i = next++; i < end; i = next++)
+            func(i);
+    } catch (...) {
+        next = end;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error)
+            error = std::current_exception();
+    }
+}
+
+void ThreadPool::run(int begin, int end, const std::function<void(int)>& func, UINT threads) {
+    std::lock_guard<std::mutex> job_lock(job_mutex);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->func = &func;
+        this->next = begin;
+        this->end = end;
+        participants = threads - 1;  // the caller is one of the threads
+        finished = 0;
+        error = nullptr;
+        generation++;
+    }
+    wake.notify_all();
+
+    // Workers use func until they finish, so wait for them even if it throws.
+    in_pool = true;
+    take(func);
+    in_pool = false;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return finished == workers.size(); });
+    if (error) {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+void parallel_for(int begin, int end, const std::function<void(int)>& func, UINT threads) {
+    static ThreadPool pool;
+
+    const UINT max_threads = pool.workers.size() + 1;
+    threads = (threads == 0) ? max_threads : std::min(threads, max_threads);
+    if (in_pool || threads <= 1 || end-begin <= 1) {
+        for (int i = begin; i < end; i++)
+            func(i);
+        return;
     }
+    pool.run(begin, end, func, threads);
 }
 
 
@@ -22,11 +22,42 @@
  * be included in the library.
  */
 
+#include <fstream>
 #include <iostream>
 
 #include "quaternion.hpp"
 
 
+/**
+ * Number of failed checks.
+ */
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cout << "FAIL: " << what << std::endl;
+        failures++;
+    }
+}
+
+/**
+ * Number of pixels where any channel differs by more than 32.
+ */
+int count_diff(Quaternion::Image& a, Quaternion::Image& b) {
+    int count = 0;
+    for (int y = 0; y < a.height; y++) {
+        for (int x = 0; x < a.width; x++) {
+            for (int c = 0; c < 3; c++) {
+                if (abs(a.get(x, y, c) - b.get(x, y, c)) > 32) {
+                    count++;
+                    break;
+                }
+            }
+        }
+    }
+    return count;
+}
+
 void img_test() {
     Quaternion::Image img(1920, 1080);
     for (int y = 0; y < 1080; y++) {
@@ -38,6 +69,46 @@ void img_test() {
         }
     }
     img.write("out.qif");
+
+    img.downsample_box(4).write("out_box.qif");
+    img.downsample_lanczos(4).write("out_lanczos.qif");
+    img.swizzle(2, 1, 0);
+    img.write("out_bgr.qif");
+
+    // File backed image, the pixels end up in the file.
+    {
+        Quaternion::Image mapped(64, 64, "out_mapped.raw");
+        mapped.fill({1, 2, 3});
+    }
+    std::ifstream fp("out_mapped.raw", std::ios::binary);
+    char px[3];
+    fp.read(px, 3);
+    check(fp && px[0] == 1 && px[1] == 2 && px[2] == 3, "mapped image pixels not in file");
+
+    // Moved from images are empty but usable, bad arguments throw.
+    Quaternion::Image moved = std::move(img);
+    img.clear();
+    img.fill({1, 1, 1});
+    img.swizzle(2, 1, 0);
+    int thrown = 0;
+    for (int factor: {0, -2}) {
+        try {
+            moved.downsample_box(factor);
+        } catch (int) {
+            thrown++;
+        }
+        try {
+            moved.downsample_lanczos(factor);
+        } catch (int) {
+            thrown++;
+        }
+    }
+    try {
+        moved.swizzle(0, 1, 3);
+    } catch (int) {
+        thrown++;
+    }
+    check(thrown == 5, "bad image arguments do not throw");
 }
 
 void render_test() {
@@ -45,7 +116,7 @@ void render_test() {
 
     Quaternion::Mesh cube = Quaternion::primitive_cube(1);
     cube.location = {3, 1, 2};
-    scene.meshes.push_back(cube);
+    scene.meshes.push_back(std::move(cube));
     scene.meshes.push_back(Quaternion::primitive_cube(2));
 
     scene.lights.push_back(Quaternion::Light({3, -2, 4}));
@@ -60,6 +131,368 @@ void render_test() {
     img.write("out.qif");
 }
 
+void progressive_test() {
+    Quaternion::Scene scene;
+    scene.width = 480;
+    scene.height = 270;
+    scene.meshes.push_back(Quaternion::primitive_cube(2));
+    scene.cam.location = {0, -5, 0};
+
+    Quaternion::RenderSettings settings;
+    settings.samples = 1;
+
+    Quaternion::Image img(480, 270), first_preview(480, 270), refined(480, 270);
+    Quaternion::FrameBuffer fb(480, 270);
+    Quaternion::render_progressive(scene, img, fb, settings, [&](Quaternion::Image& img, int pass) {
+        img.write("out_pass" + std::to_string(pass) + ".qif");
+        if (pass == 0)
+            first_preview = img;
+    });
+    refined = img;
+
+    // Refining the same fb again must not show a blocky preview.
+    Quaternion::Image second_preview(480, 270);
+    Quaternion::render_progressive(scene, img, fb, settings, [&](Quaternion::Image& img, int pass) {
+        if (pass == 0)
+            second_preview = img;
+    });
+    const int blocky = count_diff(first_preview, refined), diff = count_diff(second_preview, refined);
+    std::cout << "progressive: first preview " << blocky << " pixels off, second " << diff << std::endl;
+    check(diff < blocky / 4, "progressive preview of a refined buffer is blocky");
+}
+
+void aov_test() {
+    Quaternion::Scene scene;
+    scene.width = 480;
+    scene.height = 270;
+    Quaternion::Mesh cube = Quaternion::primitive_cube(2);
+    cube.color = {255, 120, 40};
+    scene.meshes.push_back(std::move(cube));
+    scene.cam.location = {0.5, -5, 0.7};
+
+    Quaternion::RenderSettings settings;
+    settings.samples = 2;
+
+    Quaternion::FrameBuffer fb(480, 270);
+    Quaternion::render(scene, fb, settings);
+
+    Quaternion::Image img(480, 270);
+    Quaternion::tonemap(fb, img, Quaternion::AOV_COLOR);
+    img.write("out_color.qif");
+    Quaternion::tonemap(fb, img, Quaternion::AOV_DEPTH);
+    img.write("out_depth.qif");
+    Quaternion::tonemap(fb, img, Quaternion::AOV_NORMAL);
+    img.write("out_normal.qif");
+    Quaternion::tonemap(fb, img, Quaternion::AOV_FACE_ID);
+    img.write("out_face_id.qif");
+
+
+    // A depth only buffer gives the same depth, up to sampling noise.
+    Quaternion::FrameBuffer fb2(480, 270);
+    Quaternion::render(scene, fb2, settings);
+    Quaternion::Image full(480, 270), full2(480, 270), depth_only(480, 270);
+    Quaternion::tonemap(fb, full, Quaternion::AOV_DEPTH);
+    Quaternion::tonemap(fb2, full2, Quaternion::AOV_DEPTH);
+    Quaternion::render(scene, depth_only, settings);
+    const int noise = count_diff(full, full2), diff = count_diff(full, depth_only);
+    std::cout << "aov: depth only " << diff << " pixels off, noise " << noise << std::endl;
+    check(diff <= 2*noise + 16, "depth only render differs from full frame buffer");
+
+    Quaternion::FrameBuffer depth_fb(480, 270, Quaternion::aov_bit(Quaternion::AOV_DEPTH));
+    check(depth_fb.color.empty() && depth_fb.normal.empty() && depth_fb.face_id.empty(),
+        "depth only frame buffer allocates other AOVs");
+    bool thrown = false;
+    try {
+        Quaternion::tonemap(depth_fb, img, Quaternion::AOV_COLOR);
+    } catch (int) {
+        thrown = true;
+    }
+    check(thrown, "tonemap of a missing AOV does not throw");
+}
+
+void primitives_test() {
+    Quaternion::Scene scene;
+    scene.width = 480;
+    scene.height = 270;
+
+    Quaternion::Primitive sphere = Quaternion::primitive_sphere(1);
+    sphere.location = {-2, 2, 0};
+    sphere.color = {255, 80, 80};
+    scene.primitives.push_back(sphere);
+
+    Quaternion::Primitive cyl = Quaternion::primitive_cylinder(0.7, 2);
+    cyl.location = {0.5, 2, 0};
+    scene.primitives.push_back(cyl);
+
+    Quaternion::Primitive box = Quaternion::primitive_box({1, 1, 1});
+    box.location = {2.5, 2, 0};
+    scene.primitives.push_back(box);
+
+    Quaternion::Primitive floor = Quaternion::primitive_plane({0, 0, 1});
+    floor.location = {0, 0, -1};
+    floor.color = {80, 160, 80};
+    scene.primitives.push_back(floor);
+
+    scene.meshes.push_back(Quaternion::primitive_cube(1));
+    scene.cam.location = {0, -5, 1};
+
+    Quaternion::RenderSettings settings;
+    settings.samples = 2;
+
+    Quaternion::FrameBuffer fb(480, 270);
+    Quaternion::render(scene, fb, settings);
+
+    Quaternion::Image img(480, 270);
+    Quaternion::tonemap(fb, img, Quaternion::AOV_COLOR);
+    img.write("out_primitives.qif");
+    Quaternion::tonemap(fb, img, Quaternion::AOV_MESH_ID);
+    img.write("out_primitives_id.qif");
+
+    // Every primitive and the mesh must be visible.
+    std::vector<int> counts(scene.meshes.size() + scene.primitives.size());
+    for (int id: fb.mesh_id) {
+        if (id >= 0)
+            counts[id]++;
+    }
+    for (int i = 0; i < (int)counts.size(); i++)
+        check(counts[i] > 0, "object " + std::to_string(i) + " not visible in primitives_test");
+}
+
+/**
+ * Root mean square difference of all channels.
+ */
+double rmse(Quaternion::Image& a, Quaternion::Image& b) {
+    const size_t size = (size_t)a.width * a.height * 3;
+    double sum = 0;
+    for (size_t i = 0; i < size; i++)
+        sum += (a.mem[i] - b.mem[i]) * (a.mem[i] - b.mem[i]);
+    return sqrt(sum / size);
+}
+
+void denoise_test() {
+    Quaternion::Scene scene;
+    scene.width = 240;
+    scene.height = 135;
+
+    Quaternion::Primitive sphere = Quaternion::primitive_sphere(1);
+    sphere.location = {-1.2, 2, 0};
+    sphere.color = {255, 80, 80};
+    scene.primitives.push_back(sphere);
+    Quaternion::Primitive floor = Quaternion::primitive_plane({0, 0, 1});
+    floor.location = {0, 0, -1};
+    floor.color = {80, 160, 80};
+    scene.primitives.push_back(floor);
+    Quaternion::Mesh cube = Quaternion::primitive_cube(1.2);
+    cube.location = {1.2, 2.5, -0.2};
+    cube.color = {90, 120, 255};
+    scene.meshes.push_back(std::move(cube));
+    scene.cam.location = {0, -5, 1};
+
+    Quaternion::RenderSettings settings;
+    settings.samples = 64;
+    Quaternion::FrameBuffer ref_fb(240, 135);
+    Quaternion::render(scene, ref_fb, settings);
+    Quaternion::Image ref(240, 135);
+    Quaternion::tonemap(ref_fb, ref, Quaternion::AOV_COLOR);
+
+    // Denoising a low sample render must get it closer to the reference.
+    Quaternion::DenoiseSettings dn_settings;
+    for (UINT samples: {1, 4}) {
+        settings.samples = samples;
+        Quaternion::FrameBuffer fb(240, 135);
+        Quaternion::render(scene, fb, settings);
+        Quaternion::Image raw(240, 135), denoised(240, 135);
+        Quaternion::tonemap(fb, raw, Quaternion::AOV_COLOR);
+        Quaternion::denoise(fb, dn_settings);
+        Quaternion::tonemap(fb, denoised, Quaternion::AOV_COLOR);
+        denoised.write("out_denoised" + std::to_string(samples) + ".qif");
+
+        const double before = rmse(raw, ref), after = rmse(denoised, ref);
+        std::cout << "denoise: " << samples << " spp rmse " << before << " -> " << after << std::endl;
+        check(after < before, "denoise does not improve a " + std::to_string(samples) + " spp render");
+    }
+}
+
+void cache_test() {
+    Quaternion::Scene scene;
+    scene.width = 480;
+    scene.height = 270;
+    scene.meshes.push_back(Quaternion::primitive_cube(1));
+    scene.primitives.push_back(Quaternion::primitive_sphere(0.5));
+    scene.primitives[0].location = {2, 3, 0};
+    scene.cam.location = {0, -5, 0};
+
+    Quaternion::RenderSettings settings;
+    settings.samples = 1;
+
+    Quaternion::RenderCache cache;
+    cache.load("out_cache.qrc");
+
+    // Only the tiles around the sphere are traced again.
+    Quaternion::Image img(480, 270);
+    Quaternion::render(scene, img, settings, cache);
+    scene.primitives[0].location = {2, 3, 0.5};
+    Quaternion::render(scene, img, settings, cache);
+    img.write("out_cached.qif");
+
+    cache.prune();
+    check(cache.save("out_cache.qrc"), "cache not saved");
+
+    // A saved cache loads back whole, other files are rejected.
+    Quaternion::RenderCache loaded;
+    check(loaded.load("out_cache.qrc") && loaded.tiles.size() == cache.tiles.size(), "saved cache does not load");
+    Quaternion::RenderCache other;
+    check(!other.load("out_cached.qif"), "cache loads a file that is not a cache");
+}
+
+void cache_compare_test() {
+    Quaternion::Scene scene;
+    scene.width = 64;
+    scene.height = 64;
+    scene.primitives.push_back(Quaternion::primitive_sphere(0.5));
+    scene.primitives[0].location = {0.7, 6, 0.7};
+
+    Quaternion::RenderSettings settings;
+    settings.samples = 16;
+
+    Quaternion::RenderCache cache;
+    Quaternion::Image cached(64, 64), fresh(64, 64), fresh2(64, 64);
+    Quaternion::render(scene, cached, settings, cache);
+
+    // Only sign bits of the location change. The cached render must
+    // still match an uncached one, up to sampling noise.
+    scene.primitives[0].location = {-0.7, 6, -0.7};
+    Quaternion::render(scene, cached, settings, cache);
+    Quaternion::render(scene, fresh, settings);
+    Quaternion::render(scene, fresh2, settings);
+    const int diff = count_diff(cached, fresh), noise = count_diff(fresh, fresh2);
+    std::cout << "cached vs uncached: " << diff << " pixels differ, "
+        << "uncached vs uncached: " << noise << std::endl;
+    check(diff <= 2*noise + 16, "cached render differs from uncached after a move");
+}
+
+/**
+ * Latitude longitude sphere with about 4*n*n faces.
+ */
+Quaternion::Mesh uv_sphere(int n) {
+    auto point = [n](int i, int j) {
+        const double theta = M_PI * i / n, phi = M_PI * j / n;
+        return PF3D(sin(theta)*cos(phi), sin(theta)*sin(phi), cos(theta));
+    };
+    Quaternion::Mesh mesh;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < 2*n; j++) {
+            const PF3D a = point(i, j), b = point(i+1, j), c = point(i+1, j+1), d = point(i, j+1);
+            if (i != n-1)
+                mesh.faces.push_back(Quaternion::Tri(a, b, c));
+            if (i != 0)
+                mesh.faces.push_back(Quaternion::Tri(a, c, d));
+        }
+    }
+    return mesh;
+}
+
+void lod_test() {
+    Quaternion::Scene scene;
+    scene.width = 120;
+    scene.height = 68;
+    scene.lod_error = 1;
+    scene.meshes.push_back(uv_sphere(40));
+    scene.cam.location = {0, -5, 0};
+
+    Quaternion::RenderSettings settings;
+    settings.samples = 1;
+
+    // Lods are built once. Moving the mesh away only picks coarser levels.
+    // Location is baked by each render, so it is set to the offset.
+    Quaternion::Image img(120, 68), full(120, 68), full2(120, 68);
+    size_t last_faces = SIZE_MAX;
+    for (double dy: {0.0, 10.0, 30.0}) {
+        scene.lod_error = 1;
+        scene.meshes[0].location = {0, dy, 0};
+        Quaternion::render(scene, img, settings);
+        const size_t faces = scene._fptrs.size();
+
+        scene.lod_error = 0;
+        Quaternion::render(scene, full, settings);
+        Quaternion::render(scene, full2, settings);
+        const int diff = count_diff(img, full), noise = count_diff(full, full2);
+        std::cout << faces << " faces, " << diff << " pixels differ from full mesh, "
+            << noise << " between full renders" << std::endl;
+
+        const std::string at = " at distance " + std::to_string((int)dy);
+        check(faces <= last_faces, "lod has more faces" + at);
+        check(diff <= 2*noise + 16, "lod differs from full mesh" + at);
+        last_faces = faces;
+    }
+    check(last_faces < scene.meshes[0].faces.size(), "lod of a far mesh is not decimated");
+}
+
+void buffers_test() {
+    // Octahedron from indexed buffers, moved into the mesh without copying.
+    std::vector<float> vertices = {1, 0, 0, -1, 0, 0, 0, 1, 0, 0, -1, 0, 0, 0, 1, 0, 0, -1};
+    std::vector<UINT> indices = {
+        0, 2, 4, 2, 1, 4, 1, 3, 4, 3, 0, 4,
+        2, 0, 5, 1, 2, 5, 3, 1, 5, 0, 3, 5,
+    };
+    Quaternion::Mesh mesh(std::move(vertices), std::move(indices));
+    mesh.color = {120, 200, 255};
+
+    Quaternion::Scene scene;
+    scene.width = 240;
+    scene.height = 135;
+    scene.meshes.push_back(std::move(mesh));
+    scene.cam.location = {0, -5, 0.5};
+
+    Quaternion::RenderSettings settings;
+    settings.samples = 2;
+
+    Quaternion::Image img(240, 135);
+    Quaternion::render(scene, img, settings);
+    img.write("out_buffers.qif");
+    std::cout << scene.meshes[0].faces.size() << " faces, "
+        << scene.meshes[0].indices.size() << " indices left" << std::endl;
+
+    int visible = 0;
+    for (int y = 0; y < img.height; y++)
+        for (int x = 0; x < img.width; x++)
+            visible += (img.get(x, y, 2) > 0);
+    check(scene.meshes[0].faces.size() == 8 && scene.meshes[0].indices.empty()
+        && scene.meshes[0].vertices.empty(), "indexed mesh not expanded and freed");
+    check(visible > 0, "indexed mesh not visible");
+
+    // Double vertices keep their precision.
+    const double far_verts[9] = {1e6 + 0.001, 0, 0, 1e6, 1, 0, 1e6, 0, 1};
+    const UINT far_indices[3] = {0, 1, 2};
+    Quaternion::Scene far;
+    far.width = far.height = 4;
+    far.meshes.push_back(Quaternion::mesh_from_buffers(far_verts, 3, far_indices, 1));
+    Quaternion::preprocess(far);
+    check(far.meshes[0].faces[0].p1(0) == 1e6 + 0.001, "double vertices rounded to float");
+
+    // Grid with more faces than one expansion chunk, expanded in order.
+    const int n = 300;
+    std::vector<float> grid_verts;
+    std::vector<UINT> grid_indices;
+    for (int y = 0; y <= n; y++)
+        for (int x = 0; x <= n; x++)
+            grid_verts.insert(grid_verts.end(), {(float)x, (float)y, 0});
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            const UINT a = y*(n+1) + x, b = a+1, c = a+n+2, d = a+n+1;
+            grid_indices.insert(grid_indices.end(), {a, b, c, a, c, d});
+        }
+    }
+    Quaternion::Scene grid;
+    grid.width = grid.height = 4;
+    grid.meshes.push_back(Quaternion::Mesh(std::move(grid_verts), std::move(grid_indices)));
+    Quaternion::preprocess(grid);
+    const std::vector<Quaternion::Tri>& faces = grid.meshes[0].faces;
+    const Quaternion::Tri& last = faces.back();
+    check(faces.size() == 2*n*n && last.p1 == PF3D(n-1, n-1, 0) && last.p3 == PF3D(n-1, n, 0),
+        "large indexed mesh not expanded in order");
+}
+
 int main() {
     /*
     PF3D q1 = {0, -10, 0};
@@ -68,5 +501,21 @@ int main() {
     std::cout << Quaternion::intersects(q1, q2, tri) << std::endl;
      */
 
+    img_test();
     render_test();
+    progressive_test();
+    aov_test();
+    denoise_test();
+    primitives_test();
+    cache_test();
+    cache_compare_test();
+    lod_test();
+    buffers_test();
+
+    if (failures > 0) {
+        std::cout << failures << " checks failed." << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed." << std::endl;
+    return 0;
 }